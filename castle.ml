@@ -24,56 +24,92 @@ type merge_cfg = {
     m_bandwidth: int32;
 }
 
+(* Control operations for control_batch. The order of the constructors
+   matters to the C stub. *)
+type control_op =
+    | Clone of int32 (* version *)
+    | Delete_version of int32
+    | Create of int64 * int64 (* size, opts *)
+    | Collection_attach of int32 * string (* version, name *)
+    | Collection_detach of int32
+    | Collection_snapshot of int32
+    | Vertree_compact of int32
+    | Destroy_vertree of int32
+    | Vertree_tdp_set of int32 * int64 (* vertree, seconds *)
+
+type control_result =
+    | Control_done
+    (* The new version, or collection for Collection_attach. *)
+    | Control_id of int32
+    | Control_failed of Unix.error
+
 exception Invalid_reply of string
 exception Invalid_iterator
 exception Castle_not_running
+exception Deadline_exceeded
 let _ = Callback.register_exception "Not_found" Not_found
 
 external castle_connect : unit -> connection = "caml_castle_connect"
 external castle_disconnect : connection -> unit = "caml_castle_disconnect"
 
-external castle_device_to_devno : string -> int32 = "caml_castle_device_to_devno"
-external castle_devno_to_device : int32 -> string = "caml_castle_devno_to_device"
+external castle_device_to_devno : string -> (int32 [@unboxed]) = "caml_castle_device_to_devno_byte" "caml_castle_device_to_devno"
+external castle_devno_to_device : (int32 [@unboxed]) -> string = "caml_castle_devno_to_device_byte" "caml_castle_devno_to_device"
+
+external castle_fd : connection -> file_descr = "caml_castle_fd" [@@noalloc]
+
+(* The connection's scratch arena, which the data path stubs build their
+   keys, values and requests in. *)
+type scratch_stats = {
+    high_water: int; (* Largest single reservation, in bytes. *)
+    capacity: int; (* Bytes currently held, given back after a long run of much smaller calls. *)
+    grows: int;
+    fallbacks: int; (* Calls that used a spare arena because the connection's was busy. *)
+}
+
+external castle_scratch_stats : connection -> scratch_stats = "caml_castle_scratch_stats"
 
-external castle_fd : connection -> file_descr = "caml_castle_fd"
+(* Ids, tokens and sizes cross into C unboxed/untagged in native code; the
+   first stub name is the bytecode entry point, which does the unboxing. *)
 
 (* Data path *)
-external castle_get : connection -> int32 -> string array -> string = "caml_castle_get"
-external castle_replace : connection -> int32 -> string array -> string -> unit = "caml_castle_replace"
-external castle_remove : connection -> int32 -> string array -> unit = "caml_castle_remove"
-external castle_iter_start : connection -> int32 -> string array -> string array -> int -> int32 * bool * ((string array * string) array) = "caml_castle_iter_start"
-external castle_iter_next : connection -> int32 -> int -> bool * ((string array * string) array) = "caml_castle_iter_next"
-external castle_iter_finish : connection -> int32 -> unit = "caml_castle_iter_finish"
-external castle_get_slice : connection -> int32 -> string array -> string array -> int -> (string array * string) array = "caml_castle_get_slice"
+external castle_get : connection -> (int32 [@unboxed]) -> string array -> string = "caml_castle_get_byte" "caml_castle_get"
+external castle_replace : connection -> (int32 [@unboxed]) -> string array -> string -> unit = "caml_castle_replace_byte" "caml_castle_replace"
+external castle_remove : connection -> (int32 [@unboxed]) -> string array -> unit = "caml_castle_remove_byte" "caml_castle_remove"
+external castle_multi_replace : connection -> (int32 [@unboxed]) -> (string array * string) array -> unit = "caml_castle_multi_replace_byte" "caml_castle_multi_replace"
+external castle_multi_remove : connection -> (int32 [@unboxed]) -> string array array -> unit = "caml_castle_multi_remove_byte" "caml_castle_multi_remove"
+external castle_multi_get : connection -> (int32 [@unboxed]) -> string array array -> (int [@untagged]) -> obj_value array = "caml_castle_multi_get_byte" "caml_castle_multi_get"
+external castle_iter_start : connection -> (int32 [@unboxed]) -> string array -> string array -> (int [@untagged]) -> int32 * bool * ((string array * string) array) = "caml_castle_iter_start_byte" "caml_castle_iter_start"
+external castle_iter_next : connection -> (int32 [@unboxed]) -> (int [@untagged]) -> bool * ((string array * string) array) = "caml_castle_iter_next_byte" "caml_castle_iter_next"
+external castle_iter_finish : connection -> (int32 [@unboxed]) -> unit = "caml_castle_iter_finish_byte" "caml_castle_iter_finish"
+external castle_get_slice : connection -> (int32 [@unboxed]) -> string array -> string array -> (int [@untagged]) -> (string array * string) array = "caml_castle_get_slice_byte" "caml_castle_get_slice"
 
 (* Control Path *)
-external castle_claim                           : connection -> int32 -> int32 = "caml_castle_claim"
-external castle_attach                          : connection -> int32 -> int32 = "caml_castle_attach"
-external castle_detach                          : connection -> int32 -> unit = "caml_castle_detach"
-external castle_snapshot                        : connection -> int32 -> int32 = "caml_castle_snapshot"
-external castle_collection_attach               : connection -> int32 -> string -> int -> int32 = "caml_castle_collection_attach"
-external castle_collection_reattach             : connection -> int32 -> int32 -> unit = "caml_castle_collection_reattach"
-external castle_collection_detach               : connection -> int32 -> unit = "caml_castle_collection_detach"
-external castle_collection_snapshot             : connection -> int32 -> int32 = "caml_castle_collection_snapshot"
-external castle_create                          : connection -> int64 -> int32 = "caml_castle_create"
-external castle_delete_version                  : connection -> int32 -> unit = "caml_castle_delete_version"
-external castle_destroy_vertree                 : connection -> int32 -> unit = "caml_castle_destroy_vertree"
-external castle_vertree_compact                 : connection -> int32 -> unit = "caml_castle_vertree_compact"
-external castle_clone                           : connection -> int32 -> int32 = "caml_castle_clone"
+external castle_claim                           : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_claim_byte" "caml_castle_claim"
+external castle_attach                          : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_attach_byte" "caml_castle_attach"
+external castle_detach                          : connection -> (int32 [@unboxed]) -> unit = "caml_castle_detach_byte" "caml_castle_detach"
+external castle_snapshot                        : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_snapshot_byte" "caml_castle_snapshot"
+external castle_collection_attach               : connection -> (int32 [@unboxed]) -> string -> (int32 [@unboxed]) = "caml_castle_collection_attach_byte" "caml_castle_collection_attach"
+external castle_collection_reattach             : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) -> unit = "caml_castle_collection_reattach_byte" "caml_castle_collection_reattach"
+external castle_collection_detach               : connection -> (int32 [@unboxed]) -> unit = "caml_castle_collection_detach_byte" "caml_castle_collection_detach"
+external castle_collection_snapshot             : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_collection_snapshot_byte" "caml_castle_collection_snapshot"
+external castle_create                          : connection -> (int64 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_create_byte" "caml_castle_create"
+external castle_delete_version                  : connection -> (int32 [@unboxed]) -> unit = "caml_castle_delete_version_byte" "caml_castle_delete_version"
+external castle_destroy_vertree                 : connection -> (int32 [@unboxed]) -> unit = "caml_castle_destroy_vertree_byte" "caml_castle_destroy_vertree"
+external castle_vertree_compact                 : connection -> (int32 [@unboxed]) -> unit = "caml_castle_vertree_compact_byte" "caml_castle_vertree_compact"
+external castle_clone                           : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_clone_byte" "caml_castle_clone"
 external castle_init                            : connection -> unit = "caml_castle_init"
-external castle_fault                           : connection -> int32 -> int32 -> unit = "caml_castle_fault"
-external castle_environment_set                 : connection -> int32 -> string -> unit = "caml_castle_environment_set"
-external castle_slave_evacuate                  : connection -> int32 -> int32 -> unit = "caml_castle_slave_evacuate"
-external castle_slave_scan                      : connection -> int32 -> unit = "caml_castle_slave_scan"
-external castle_thread_priority                 : connection -> int32 -> unit = "caml_castle_thread_priority"
-external castle_ctrl_prog_deregister            : connection -> bool -> int32 = "caml_castle_ctrl_prog_deregister"
-external castle_create_with_opts                : connection -> int64 -> int64 -> int32 = "caml_castle_create_with_opts"
-external castle_vertree_tdp_set                 : connection -> int32 -> int64 -> unit = "caml_castle_vertree_compact"
-(* NB additional function name is necessary since function has more than 5 params.
-   Yes you read that right. See http://caml.inria.fr/pub/docs/manual-ocaml/manual032.html#htoc218.
-   This also means ocaml-castle won't work with bytecode-interpreted OCaml programs
-   until someone implements bytecode_bullshit in the C part. *)
-external castle_merge_start                     : connection -> int32 -> int32 array -> int32 -> int64 array -> rda_type -> rda_type -> int32 -> int32 = "bytecode_bullshit" "caml_castle_merge_start"
+external castle_fault                           : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) -> unit = "caml_castle_fault_byte" "caml_castle_fault"
+external castle_environment_set                 : connection -> (int32 [@unboxed]) -> string -> unit = "caml_castle_environment_set_byte" "caml_castle_environment_set"
+external castle_slave_evacuate                  : connection -> (int32 [@unboxed]) -> (int32 [@unboxed]) -> unit = "caml_castle_slave_evacuate_byte" "caml_castle_slave_evacuate"
+external castle_slave_scan                      : connection -> (int32 [@unboxed]) -> unit = "caml_castle_slave_scan_byte" "caml_castle_slave_scan"
+external castle_thread_priority                 : connection -> (int32 [@unboxed]) -> unit = "caml_castle_thread_priority_byte" "caml_castle_thread_priority"
+external castle_ctrl_prog_deregister            : connection -> bool -> (int32 [@unboxed]) = "caml_castle_ctrl_prog_deregister_byte" "caml_castle_ctrl_prog_deregister"
+external castle_create_with_opts                : connection -> (int64 [@unboxed]) -> (int64 [@unboxed]) -> (int32 [@unboxed]) = "caml_castle_create_with_opts_byte" "caml_castle_create_with_opts"
+external castle_vertree_tdp_set                 : connection -> (int32 [@unboxed]) -> (int64 [@unboxed]) -> unit = "caml_castle_vertree_tdp_set_byte" "caml_castle_vertree_tdp_set"
+external castle_control_batch                   : connection -> control_op array -> control_result array = "caml_castle_control_batch"
+(* More than five arguments, so bytecode gets its own stub taking an argv array.
+   See http://caml.inria.fr/pub/docs/manual-ocaml/manual032.html#htoc218. *)
+external castle_merge_start                     : connection -> int32 -> int32 array -> int32 -> int64 array -> rda_type -> rda_type -> int32 -> int32 = "caml_castle_merge_start_byte" "caml_castle_merge_start"
 
 let connect () =
     try
@@ -86,32 +122,300 @@ let disconnect connection =
 
 let connection_fd conn = castle_fd conn
 
+let scratch_stats conn = castle_scratch_stats conn
+
+(* Big-endian integers, as used by the dump and trace file formats. *)
+let output_u32 oc n =
+    output_byte oc ((n lsr 24) land 0xff);
+    output_byte oc ((n lsr 16) land 0xff);
+    output_byte oc ((n lsr 8) land 0xff);
+    output_byte oc (n land 0xff)
+
+let output_u64 oc n =
+    output_u32 oc ((n lsr 32) land 0xffffffff);
+    output_u32 oc (n land 0xffffffff)
+
+let input_u32 ic =
+    let b0 = input_byte ic in
+    let b1 = input_byte ic in
+    let b2 = input_byte ic in
+    let b3 = input_byte ic in
+    (b0 lsl 24) lor (b1 lsl 16) lor (b2 lsl 8) lor b3
+
+let input_u64 ic =
+    let hi = input_u32 ic in
+    let lo = input_u32 ic in
+    (hi lsl 32) lor lo
+
+(* Workload capture. While a trace is being recorded every data-path call
+   appends an entry to the trace file describing its shape and timing. Keys
+   are recorded by their dimension lengths and values by their size, never
+   by their contents, so traces stay compact and carry no user data. *)
+module Trace = struct
+    type op =
+        | Get
+        | Replace
+        | Remove
+        | Get_slice
+        | Iter_start
+        | Iter_next
+        | Iter_finish
+        | Multi_replace
+        | Multi_remove
+        | Multi_get
+
+    type status =
+        | Done
+        | Missing
+        | Failed
+
+    type entry = {
+        op: op;
+        status: status;
+        (* The collection, or the iterator token for iter_next/iter_finish. *)
+        collection: int32;
+        (* The token handed out by iter_start, 0 for other calls. *)
+        token: int32;
+        (* The thread that made the call. *)
+        stream: int;
+        (* Length of each dimension of the (first, start) key. *)
+        key_shape: int array;
+        (* Total size of the values written or read. *)
+        value_size: int;
+        (* The limit or batch size asked for, or the number of pairs in a
+           multi_replace or keys in a multi_remove or multi_get. *)
+        count: int;
+        timestamp: float;
+        latency: float;
+    }
+
+    let magic = "CSTLTRC2"
+    (* Traces from before streams were recorded; read as a single stream. *)
+    let magic_v1 = "CSTLTRC1"
+
+    let ops = [| Get; Replace; Remove; Get_slice; Iter_start; Iter_next; Iter_finish; Multi_replace; Multi_remove; Multi_get |]
+    let statuses = [| Done; Missing; Failed |]
+
+    let index_of x xs =
+        let rec loop i = if xs.(i) = x then i else loop (i + 1) in
+        loop 0
+
+    (* The trace being written, if any. Only read without the lock to
+       decide whether a call needs recording at all. *)
+    let recorder = ref None
+    let lock = Mutex.create ()
+
+    let write oc e =
+        let dims = min (Array.length e.key_shape) 0xff in
+        output_byte oc (index_of e.op ops);
+        output_byte oc (index_of e.status statuses);
+        output_byte oc dims;
+        output_u32 oc (Int32.to_int e.collection land 0xffffffff);
+        output_u32 oc (Int32.to_int e.token land 0xffffffff);
+        output_u32 oc (e.stream land 0xffffffff);
+        output_u64 oc (int_of_float (e.timestamp *. 1e6));
+        output_u32 oc (min (int_of_float (e.latency *. 1e6)) 0xffffffff);
+        output_u32 oc (min e.value_size 0xffffffff);
+        output_u32 oc (min e.count 0xffffffff);
+        for i = 0 to dims - 1 do
+            output_u32 oc (min e.key_shape.(i) 0xffffffff)
+        done
+
+    let read ~streams ic =
+        let op = ops.(input_byte ic) in
+        let status = statuses.(input_byte ic) in
+        let dims = input_byte ic in
+        let collection = Int32.of_int (input_u32 ic) in
+        let token = Int32.of_int (input_u32 ic) in
+        let stream = if streams then input_u32 ic else 0 in
+        let timestamp = float_of_int (input_u64 ic) /. 1e6 in
+        let latency = float_of_int (input_u32 ic) /. 1e6 in
+        let value_size = input_u32 ic in
+        let count = input_u32 ic in
+        let key_shape = Array.init dims (fun _ -> input_u32 ic) in
+        {
+            op = op;
+            status = status;
+            collection = collection;
+            token = token;
+            stream = stream;
+            key_shape = key_shape;
+            value_size = value_size;
+            count = count;
+            timestamp = timestamp;
+            latency = latency;
+        }
+
+    (* Called with the lock held. *)
+    let close_recorder () =
+        (match !recorder with
+         | Some oc -> close_out_noerr oc
+         | None -> ());
+        recorder := None
+
+    let stop () =
+        Mutex.lock lock;
+        close_recorder ();
+        Mutex.unlock lock
+
+    (* Starts recording every call, from any thread, to filename. *)
+    let start filename =
+        let oc = open_out_bin filename in
+        (try output_string oc magic with e -> close_out_noerr oc; raise e);
+        Mutex.lock lock;
+        close_recorder ();
+        recorder := Some oc;
+        Mutex.unlock lock
+
+    let recording () = match !recorder with None -> false | Some _ -> true
+
+    (* Tracing must never fail the call it traces: if the trace cannot be
+       written, a full disk say, recording just stops. *)
+    let record e =
+        Mutex.lock lock;
+        (match !recorder with
+         | Some oc -> (try write oc e with _ -> close_recorder ())
+         | None -> ());
+        Mutex.unlock lock
+
+    let iter f filename =
+        let ic = open_in_bin filename in
+        let finish () = close_in_noerr ic in
+        (try
+            let streams =
+                match really_input_string ic (String.length magic) with
+                | m when m = magic -> true
+                | m when m = magic_v1 -> false
+                | _ -> failwith (sprintf "Castle.Trace: %s is not a trace" filename)
+            in
+            while true do
+                f (read ~streams ic)
+            done
+        with
+        | End_of_file -> finish ()
+        | e -> finish (); raise e)
+
+    let pairs_size kvs = Array.fold_left (fun n (_, v) -> n + String.length v) 0 kvs
+
+    let values_size vs =
+        Array.fold_left (fun n v ->
+            match v with
+            | Value v -> n + String.length v
+            | Tombstone -> n) 0 vs
+
+    let finished value_size _ = (Done, value_size, 0l)
+
+    (* Runs f, recording it as op. info tells how the call went from its
+       result; shape gives the key's dimension lengths. Callers check
+       recording () first and call the stub directly when it is false, so
+       that untraced calls build no closures. *)
+    let traced_shape op collection shape count info f =
+        let t0 = Unix.gettimeofday () in
+        let log status value_size token =
+            record {
+                op = op;
+                status = status;
+                collection = collection;
+                token = token;
+                stream = Thread.id (Thread.self ());
+                key_shape = shape ();
+                value_size = value_size;
+                count = count;
+                timestamp = t0;
+                latency = Unix.gettimeofday () -. t0;
+            }
+        in
+        let r = try f () with e -> log Failed 0 0l; raise e in
+        let status, value_size, token = info r in
+        log status value_size token;
+        r
+
+    let traced op collection key count info f =
+        traced_shape op collection (fun () -> Array.map String.length key) count info f
+end
+
 (* Data Path *)
 
-let get conn c k = 
+let get_untraced conn c k =
         try Value (castle_get conn c k)
-        with Not_found -> Tombstone 
+        with Not_found -> Tombstone
+
+let get conn c k = 
+        if not (Trace.recording ()) then get_untraced conn c k
+        else Trace.traced Trace.Get c k 0
+            (function
+                | Value v -> (Trace.Done, String.length v, 0l)
+                | Tombstone -> (Trace.Missing, 0, 0l))
+            (fun () -> get_untraced conn c k)
+
+(* Gets every key with a single batched submission, like multi_replace.
+   Each key gets a value_size byte slot to read into; a value larger than
+   that costs a get of its own. *)
+let multi_get ?(value_size = 1024) conn c ks =
+        if not (Trace.recording ()) then castle_multi_get conn c ks value_size
+        else
+            let first = if Array.length ks > 0 then ks.(0) else [||] in
+            Trace.traced Trace.Multi_get c first (Array.length ks)
+                (fun vs -> (Trace.Done, Trace.values_size vs, 0l))
+                (fun () -> castle_multi_get conn c ks value_size)
+
+let remove conn c k =
+        if not (Trace.recording ()) then castle_remove conn c k
+        else Trace.traced Trace.Remove c k 0 (Trace.finished 0)
+            (fun () -> castle_remove conn c k)
 
-let remove conn c k = castle_remove conn c k
+let replace conn c k v =
+        if not (Trace.recording ()) then castle_replace conn c k v
+        else Trace.traced Trace.Replace c k 0 (Trace.finished (String.length v))
+            (fun () -> castle_replace conn c k v)
 
-let replace conn c k v = castle_replace conn c k v
+let multi_replace conn c kvps =
+        if not (Trace.recording ()) then castle_multi_replace conn c kvps
+        else
+            let first = if Array.length kvps > 0 then fst kvps.(0) else [||] in
+            Trace.traced Trace.Multi_replace c first (Array.length kvps)
+                (Trace.finished (Trace.pairs_size kvps))
+                (fun () -> castle_multi_replace conn c kvps)
+
+let multi_remove conn c ks =
+        if not (Trace.recording ()) then castle_multi_remove conn c ks
+        else
+            let first = if Array.length ks > 0 then ks.(0) else [||] in
+            Trace.traced Trace.Multi_remove c first (Array.length ks) (Trace.finished 0)
+                (fun () -> castle_multi_remove conn c ks)
 
 let iter_start connection c start finish batch_size = 
-	let token, more, arr = castle_iter_start connection c start finish batch_size in
+	let token, more, arr =
+		if not (Trace.recording ()) then castle_iter_start connection c start finish batch_size
+		else Trace.traced Trace.Iter_start c start batch_size
+			(fun (token, _, arr) -> (Trace.Done, Trace.pairs_size arr, token))
+			(fun () -> castle_iter_start connection c start finish batch_size) in
 		(token, more, Array.map (fun (k,v) -> (k, Value v)) arr)
 let iter_next connection t batch_size = 
-	let more, arr = castle_iter_next connection t batch_size in
+	let more, arr =
+		if not (Trace.recording ()) then castle_iter_next connection t batch_size
+		else Trace.traced Trace.Iter_next t [||] batch_size
+			(fun (_, arr) -> (Trace.Done, Trace.pairs_size arr, 0l))
+			(fun () -> castle_iter_next connection t batch_size) in
 		(more, Array.map (fun (k,v) -> (k, Value v)) arr)
-let iter_finish connection t = castle_iter_finish connection t
+let iter_finish connection t =
+	if not (Trace.recording ()) then castle_iter_finish connection t
+	else Trace.traced Trace.Iter_finish t [||] 0 (Trace.finished 0)
+		(fun () -> castle_iter_finish connection t)
 (* 'limit' means the maximum number of values to return. 0 means unlimited. *)
-let get_slice connection c start finish limit = Array.map (fun (k,v) -> (k, Value v)) (castle_get_slice connection c start finish limit)
+let get_slice connection c start finish limit =
+	let arr =
+		if not (Trace.recording ()) then castle_get_slice connection c start finish limit
+		else Trace.traced Trace.Get_slice c start limit
+			(fun arr -> (Trace.Done, Trace.pairs_size arr, 0l))
+			(fun () -> castle_get_slice connection c start finish limit) in
+	Array.map (fun (k,v) -> (k, Value v)) arr
 
 (*****************************************
  * Things not implemented by new interface 
  *****************************************)
 
 let nimsg = "Not implemented in new interface but will be Soon™"
-let multi_replace connection c kvps = failwith nimsg
 let iter_replace_last connection t i v = failwith nimsg
 
 (* Control Path *)
@@ -175,7 +479,7 @@ let snapshot_dev connection ~(device: string) = castle_snapshot connection (cast
 let init connection = castle_init connection
 
 let collection_attach connection ~(version:int32) ~name = 
-        castle_collection_attach connection version name (String.length name)
+        castle_collection_attach connection version name
 
 let collection_reattach connection ~(collection:int32) ~(new_version:int32) =
         castle_collection_reattach connection collection new_version
@@ -194,3 +498,1677 @@ let environment_set connection id data =
   | Hostname -> 3l
   in
   castle_environment_set connection id_n data
+
+(* Runs a batch of control operations in one call into the stubs. The ops
+   are still issued one ioctl at a time, in order, on this connection; the
+   batch only saves releasing and retaking the runtime lock around each.
+   Every op is attempted, and result i is the outcome of op i. *)
+let control_batch connection ops = castle_control_batch connection ops
+
+(* A read-only view across several collections. Each collection is
+   snapshotted and the frozen version is attached under a private name;
+   reads made through the snapshot go to those attachments, so writers on the
+   original collections carry on undisturbed.
+   Castle snapshots one collection at a time, so each view is only
+   consistent with itself: a write landing between two snapshots shows in
+   one view and not the other. For views consistent with each other, pass
+   a quiesce function that holds the writers off while it runs the
+   function it is given, which takes the snapshots and nothing else. *)
+module Snapshot = struct
+    type t = {
+        s_conn: connection;
+        (* (original collection, frozen version, read-only collection) *)
+        mutable s_views: (collection_id * version_id * collection_id) list;
+    }
+
+    let view_name collection version = sprintf "snapshot.%ld.%ld" collection version
+
+    (* Every view is detached and every detached view's version deleted,
+       whatever fails along the way; the first failure is then re-raised.
+       Views that could not be detached are kept, so release can be
+       retried, and their versions are left alone. *)
+    let release t =
+        let failure = ref None in
+        let attempt f =
+            try f (); true
+            with e -> (if !failure = None then failure := Some e); false
+        in
+        let detached, kept = List.partition (fun (_, _, ro) ->
+            attempt (fun () -> collection_detach t.s_conn ~collection:ro)) t.s_views
+        in
+        t.s_views <- kept;
+        List.iter (fun (_, version, _) ->
+            ignore (attempt (fun () -> delete_version t.s_conn ~version))) detached;
+        match !failure with
+        | Some e -> raise e
+        | None -> ()
+
+    (* Unlike 'snapshot' on a device, which returns the new leaf, the
+       collection snapshot ioctl moves the collection on to a fresh child
+       version and hands back the version it was at: the snapshot, now
+       immutable. release relies on this; it deletes that version, which
+       must never be the one the collection is writing to. *)
+    let take ?(quiesce = fun f -> f ()) connection ~collections =
+        let t = { s_conn = connection; s_views = [] } in
+        (* Snapshots not yet attached, most recent first. *)
+        let frozen = ref [] in
+        (try
+            quiesce (fun () ->
+                List.iter (fun c ->
+                    let version = collection_take_snapshot connection ~collection:c in
+                    frozen := (c, version) :: !frozen) collections);
+            List.iter (fun (c, version) ->
+                let ro = collection_attach connection ~version ~name:(view_name c version) in
+                frozen := List.filter (fun (_, v) -> v <> version) !frozen;
+                t.s_views <- (c, version, ro) :: t.s_views) (List.rev !frozen)
+        with e ->
+            List.iter (fun (_, version) ->
+                try delete_version connection ~version with _ -> ()) !frozen;
+            (try release t with _ -> ());
+            raise e);
+        t.s_views <- List.rev t.s_views;
+        t
+
+    let with_snapshot ?quiesce connection ~collections f =
+        let t = take ?quiesce connection ~collections in
+        let result = try f t with e -> (try release t with _ -> ()); raise e in
+        release t;
+        result
+
+    let collection t c =
+        let rec find = function
+            | [] -> raise Not_found
+            | (c', _, ro) :: rest -> if c' = c then ro else find rest
+        in
+        find t.s_views
+
+    let version t c =
+        let rec find = function
+            | [] -> raise Not_found
+            | (c', v, _) :: rest -> if c' = c then v else find rest
+        in
+        find t.s_views
+
+    let get t c k = get t.s_conn (collection t c) k
+    let get_slice t c start finish limit = get_slice t.s_conn (collection t c) start finish limit
+    let iter_start t c start finish batch_size = iter_start t.s_conn (collection t c) start finish batch_size
+    let iter_next t token batch_size = iter_next t.s_conn token batch_size
+    let iter_finish t token = iter_finish t.s_conn token
+end
+
+(* Collection dumps. A dump is a sorted file of key/value pairs, laid out as
+
+     "CSTLDMP1"
+     entries, grouped into blocks of roughly block_size bytes
+     block index: for each block, u64 offset and the block's first key
+     footer: u64 index offset, u64 block count, u64 entry count, "CSTLDMP1"
+
+   where a key is a u32 dimension count followed by u32-length-prefixed
+   dimensions, an entry is a key followed by a u32-length-prefixed value,
+   and all integers are big-endian. A dump is opened by mmapping it, and
+   lookups and scans are served straight from the mapping. *)
+module Dump = struct
+    let magic = "CSTLDMP1"
+    let footer_size = 32
+
+    type t = {
+        d_map: (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t;
+        (* (offset, first key) of each block, in key order. *)
+        d_index: (int * obj_key) array;
+        (* Entries occupy [String.length magic, d_data_end). *)
+        d_data_end: int;
+        d_entries: int;
+    }
+
+    (* Castle orders keys dimension by dimension. *)
+    let compare_key a b =
+        let la = Array.length a and lb = Array.length b in
+        let rec loop i =
+            if i = la || i = lb then compare la lb
+            else match String.compare a.(i) b.(i) with
+                | 0 -> loop (i + 1)
+                | c -> c
+        in
+        loop 0
+
+    (* Empty dimensions in the bounds of a range mean -inf/+inf, as for
+       get_slice, and so do dimensions missing from the bounds altogether; a
+       range covers the keys whose every dimension lies within the
+       corresponding bounds. *)
+    let past_end k finish =
+        let lk = Array.length k and lf = Array.length finish in
+        let rec loop i =
+            if i = lk || i = lf then false
+            else if finish.(i) = "" then false
+            else match String.compare k.(i) finish.(i) with
+                | 0 -> loop (i + 1)
+                | c -> c > 0
+        in
+        loop 0
+
+    let in_bounds start finish k =
+        let ok = ref true in
+        Array.iteri (fun i d ->
+            if i < Array.length start && start.(i) <> "" && String.compare d start.(i) < 0 then
+                ok := false;
+            if i < Array.length finish && finish.(i) <> "" && String.compare d finish.(i) > 0 then
+                ok := false) k;
+        !ok
+
+    let output_key oc k =
+        output_u32 oc (Array.length k);
+        Array.iter (fun d -> output_u32 oc (String.length d); output_string oc d) k
+
+    let read_u32 m off =
+        (Char.code m.{off} lsl 24) lor (Char.code m.{off + 1} lsl 16)
+        lor (Char.code m.{off + 2} lsl 8) lor Char.code m.{off + 3}
+
+    let read_u64 m off = (read_u32 m off lsl 32) lor read_u32 m (off + 4)
+
+    let read_string m off len = String.init len (fun i -> m.{off + i})
+
+    let read_key m off =
+        let dims = read_u32 m off in
+        let off = ref (off + 4) in
+        let key = Array.init dims (fun _ ->
+            let len = read_u32 m !off in
+            let d = read_string m (!off + 4) len in
+            off := !off + 4 + len;
+            d)
+        in
+        key, !off
+
+    (* Returns the key, the value's offset and length, and the next entry's
+       offset, without copying the value out. *)
+    let read_entry m off =
+        let k, off = read_key m off in
+        let len = read_u32 m off in
+        k, off + 4, len, off + 4 + len
+
+    (* Writes a dump of the pairs that feed passes, batch by batch, to the
+       function it is given, returning the number of entries written. The
+       pairs must arrive in key order. *)
+    let write_with ?(block_size = 65536) filename feed =
+        let oc = open_out_bin filename in
+        let index = ref [] and nr_blocks = ref 0 and entries = ref 0 in
+        let block_start = ref (-1) and last = ref None in
+        let write_entry (k, v) =
+            (match !last with
+             | Some k' when compare_key k' k >= 0 ->
+                invalid_arg "Castle.Dump: keys out of order"
+             | _ -> ());
+            last := Some k;
+            let v = match v with Value v -> v | Tombstone -> "" in
+            let pos = pos_out oc in
+            if !block_start < 0 || pos - !block_start >= block_size then begin
+                block_start := pos;
+                index := (pos, k) :: !index;
+                incr nr_blocks
+            end;
+            output_key oc k;
+            output_u32 oc (String.length v);
+            output_string oc v;
+            incr entries
+        in
+        (try
+            output_string oc magic;
+            feed (Array.iter write_entry);
+            let index_offset = pos_out oc in
+            List.iter (fun (pos, k) -> output_u64 oc pos; output_key oc k) (List.rev !index);
+            output_u64 oc index_offset;
+            output_u64 oc !nr_blocks;
+            output_u64 oc !entries;
+            output_string oc magic;
+            close_out oc
+        with e ->
+            close_out_noerr oc;
+            (try Sys.remove filename with _ -> ());
+            raise e);
+        !entries
+
+    (* Writes pairs, sorted by key, to filename as a dump. *)
+    let write ?block_size filename pairs =
+        write_with ?block_size filename (fun emit -> emit pairs)
+
+    (* Streams [start, finish] of the collection into filename, returning the
+       number of entries written. *)
+    let export ?(batch_size = 1024) ?block_size connection c start finish filename =
+        write_with ?block_size filename (fun emit ->
+            let token, more, kvs = iter_start connection c start finish batch_size in
+            let more = ref more in
+            try
+                emit kvs;
+                while !more do
+                    let m, kvs = iter_next connection token batch_size in
+                    emit kvs;
+                    more := m
+                done
+            with e ->
+                if !more then (try iter_finish connection token with _ -> ());
+                raise e)
+
+    let open_file filename =
+        let fd = Unix.openfile filename [Unix.O_RDONLY] 0 in
+        let m =
+            try
+                Bigarray.array1_of_genarray
+                    (Unix.map_file fd Bigarray.char Bigarray.c_layout false [|-1|])
+            with e -> Unix.close fd; raise e
+        in
+        (* The mapping outlives the descriptor. *)
+        Unix.close fd;
+        let len = Bigarray.Array1.dim m in
+        let mlen = String.length magic in
+        if len < mlen + footer_size
+            || read_string m 0 mlen <> magic
+            || read_string m (len - mlen) mlen <> magic then
+            failwith (sprintf "Castle.Dump: %s is not a collection dump" filename);
+        let index_offset = read_u64 m (len - footer_size) in
+        let nr_blocks = read_u64 m (len - footer_size + 8) in
+        let off = ref index_offset in
+        let index = Array.init nr_blocks (fun _ ->
+            let pos = read_u64 m !off in
+            let k, next = read_key m (!off + 8) in
+            off := next;
+            (pos, k))
+        in
+        {
+            d_map = m;
+            d_index = index;
+            d_data_end = index_offset;
+            d_entries = read_u64 m (len - footer_size + 16);
+        }
+
+    let length t = t.d_entries
+
+    (* The last block whose first key is <= k, or -1 if there is none. *)
+    let find_block t k =
+        let lo = ref 0 and hi = ref (Array.length t.d_index) in
+        while !lo < !hi do
+            let mid = (!lo + !hi) / 2 in
+            if compare_key (snd t.d_index.(mid)) k <= 0 then lo := mid + 1 else hi := mid
+        done;
+        !lo - 1
+
+    let get t k =
+        let b = find_block t k in
+        if b < 0 then Tombstone else
+        let stop =
+            if b + 1 < Array.length t.d_index then fst t.d_index.(b + 1) else t.d_data_end
+        in
+        let rec scan off =
+            if off >= stop then Tombstone else
+            let k', voff, vlen, next = read_entry t.d_map off in
+            match compare_key k' k with
+            | 0 -> Value (read_string t.d_map voff vlen)
+            | c when c > 0 -> Tombstone
+            | _ -> scan next
+        in
+        scan (fst t.d_index.(b))
+
+    let iter_range f t start finish =
+        if Array.length t.d_index > 0 then begin
+            let rec scan off =
+                if off < t.d_data_end then begin
+                    let k, voff, vlen, next = read_entry t.d_map off in
+                    if not (past_end k finish) then begin
+                        if in_bounds start finish k then
+                            f k (read_string t.d_map voff vlen);
+                        scan next
+                    end
+                end
+            in
+            scan (fst t.d_index.(max 0 (find_block t start)))
+        end
+
+    let iter f t = iter_range f t [||] [||]
+
+    (* 'limit' means the maximum number of values to return. 0 means unlimited. *)
+    let get_slice t start finish limit =
+        let acc = ref [] and n = ref 0 in
+        (try
+            iter_range (fun k v ->
+                acc := (k, Value v) :: !acc;
+                incr n;
+                if limit > 0 && !n >= limit then raise Exit) t start finish
+        with Exit -> ());
+        Array.of_list (List.rev !acc)
+
+    (* Loads a dump into a collection, batch_size pairs per multi_replace. *)
+    let import ?(batch_size = 256) connection c t =
+        let batch = ref [] and n = ref 0 in
+        let flush () =
+            if !n > 0 then begin
+                multi_replace connection c (Array.of_list (List.rev !batch));
+                batch := [];
+                n := 0
+            end
+        in
+        iter (fun k v ->
+            batch := (k, v) :: !batch;
+            incr n;
+            if !n >= batch_size then flush ()) t;
+        flush ()
+end
+
+(* Applies f to every element of xs, each on its own thread, re-raising
+   the first failure once all have finished. *)
+let parallel f xs =
+    match Array.length xs with
+    | 0 -> [||]
+    | 1 -> [| f xs.(0) |]
+    | n ->
+        let results = Array.make n None in
+        let threads = Array.mapi (fun i x ->
+            Thread.create (fun () ->
+                results.(i) <- Some (try `Ok (f x) with e -> `Error e)) ()) xs
+        in
+        Array.iter Thread.join threads;
+        Array.map (function
+            | Some (`Ok r) -> r
+            | Some (`Error e) -> raise e
+            | None -> assert false) results
+
+(* One logical keyspace spread over several collections, each of which may
+   sit on its own vertree. Keys are routed on a single dimension, either by
+   hash or by ranges of that dimension; requests that touch several shards are
+   issued to them in parallel, one thread per shard. *)
+module Sharded = struct
+    type routing =
+        (* Route on a hash of the given key dimension. *)
+        | Hash of int
+        (* Route on the given key dimension: shard i holds the values below
+           split point i, the last shard everything from the final split
+           point up. There is one split point fewer than there are shards. *)
+        | Range of int * string array
+
+    type shard = {
+        sh_conn: connection;
+        sh_collection: collection_id;
+    }
+
+    type t = {
+        routing: routing;
+        shards: shard array;
+        (* Whether the shard connections were opened by us. *)
+        owned: bool;
+    }
+
+    let check_routing routing nr_shards =
+        if nr_shards < 1 then invalid_arg "Castle.Sharded: no shards";
+        match routing with
+        | Hash _ -> ()
+        | Range (_, splits) ->
+            if Array.length splits <> nr_shards - 1 then
+                invalid_arg "Castle.Sharded: need one split point fewer than shards";
+            (* shard_index binary searches the split points. *)
+            for i = 1 to Array.length splits - 1 do
+                if compare splits.(i - 1) splits.(i) >= 0 then
+                    invalid_arg "Castle.Sharded: split points must be strictly increasing"
+            done
+
+    let of_collections ~routing collections =
+        check_routing routing (Array.length collections);
+        {
+            routing = routing;
+            shards = Array.map (fun (conn, c) -> { sh_conn = conn; sh_collection = c }) collections;
+            owned = false;
+        }
+
+    (* Creates a vertree per shard and attaches collection name.i to it. Each
+       shard gets its own connection, so that fanned-out requests run
+       concurrently. create_with_opts returns a vertree's root version, and
+       vertree_of_version, which the caller must obtain outside these
+       bindings, gives the vertree's id from it; that id is needed to
+       destroy the vertrees again should a later shard fail. *)
+    let create ~routing ~name ~size ~opts ~shards ~vertree_of_version =
+        check_routing routing shards;
+        let opened = ref [] and vertrees = ref [] and attached = ref [] in
+        try
+            let shards = Array.init shards (fun i ->
+                let conn = connect () in
+                opened := conn :: !opened;
+                let version = create_with_opts conn ~size ~opts in
+                vertrees := (conn, vertree_of_version version) :: !vertrees;
+                let c = collection_attach conn ~version ~name:(sprintf "%s.%d" name i) in
+                attached := (conn, c) :: !attached;
+                { sh_conn = conn; sh_collection = c })
+            in
+            { routing = routing; shards = shards; owned = true }
+        with e ->
+            List.iter (fun (conn, collection) ->
+                try collection_detach conn ~collection with _ -> ()) !attached;
+            List.iter (fun (conn, vertree) ->
+                try destroy_vertree conn ~vertree with _ -> ()) !vertrees;
+            List.iter disconnect !opened;
+            raise e
+
+    let close t =
+        if t.owned then Array.iter (fun sh -> disconnect sh.sh_conn) t.shards
+
+    let collections t = Array.map (fun sh -> sh.sh_collection) t.shards
+
+    (* FNV-1a; stable across processes and compiler versions, unlike
+       Hashtbl.hash, since it decides where data lives. *)
+    let hash s =
+        let h = ref 0x811c9dc5 in
+        String.iter (fun ch ->
+            h := ((!h lxor Char.code ch) * 0x01000193) land 0xffffffff) s;
+        !h
+
+    let dimension k d =
+        if d >= Array.length k then invalid_arg "Castle.Sharded: key lacks the routing dimension";
+        k.(d)
+
+    let shard_index t k =
+        match t.routing with
+        | Hash d -> hash (dimension k d) mod Array.length t.shards
+        | Range (d, splits) ->
+            let v = dimension k d in
+            (* The first split point above v. *)
+            let lo = ref 0 and hi = ref (Array.length splits) in
+            while !lo < !hi do
+                let mid = (!lo + !hi) / 2 in
+                if String.compare v splits.(mid) < 0 then hi := mid else lo := mid + 1
+            done;
+            !lo
+
+    (* The shards that may hold keys in [start, finish]. *)
+    let shards_for_range t start finish =
+        let n = Array.length t.shards in
+        match t.routing with
+        | Hash _ -> Array.init n (fun i -> i)
+        | Range (d, splits) ->
+            let bound k = if d < Array.length k then k.(d) else "" in
+            let lo = bound start and hi = bound finish in
+            let wanted = ref [] in
+            for i = n - 1 downto 0 do
+                if (i = n - 1 || lo = "" || String.compare lo splits.(i) < 0)
+                    && (i = 0 || hi = "" || String.compare hi splits.(i - 1) >= 0) then
+                    wanted := i :: !wanted
+            done;
+            Array.of_list !wanted
+
+    (* Splits xs by shard, keeping each element's position in xs. *)
+    let group t key_of xs =
+        let buckets = Array.make (Array.length t.shards) [] in
+        for i = Array.length xs - 1 downto 0 do
+            let s = shard_index t (key_of xs.(i)) in
+            buckets.(s) <- (i, xs.(i)) :: buckets.(s)
+        done;
+        let busy = ref [] in
+        for s = Array.length buckets - 1 downto 0 do
+            if buckets.(s) <> [] then busy := (s, Array.of_list buckets.(s)) :: !busy
+        done;
+        Array.of_list !busy
+
+    let shard_for t k = t.shards.(shard_index t k)
+
+    let get t k = let sh = shard_for t k in get sh.sh_conn sh.sh_collection k
+    let replace t k v = let sh = shard_for t k in replace sh.sh_conn sh.sh_collection k v
+    let remove t k = let sh = shard_for t k in remove sh.sh_conn sh.sh_collection k
+
+    let multi_replace t kvps =
+        ignore (parallel (fun (s, items) ->
+            let sh = t.shards.(s) in
+            multi_replace sh.sh_conn sh.sh_collection (Array.map snd items)) (group t fst kvps))
+
+    (* The shards are read in parallel, each with one multi_get. *)
+    let multi_get ?value_size t ks =
+        let out = Array.make (Array.length ks) Tombstone in
+        ignore (parallel (fun (s, items) ->
+            let sh = t.shards.(s) in
+            let vs = multi_get ?value_size sh.sh_conn sh.sh_collection (Array.map snd items) in
+            Array.iteri (fun j (i, _) -> out.(i) <- vs.(j)) items) (group t (fun k -> k) ks));
+        out
+
+    (* 'limit' means the maximum number of values to return. 0 means unlimited. *)
+    let get_slice t start finish limit =
+        let parts = parallel (fun s ->
+            let sh = t.shards.(s) in
+            get_slice sh.sh_conn sh.sh_collection start finish limit)
+            (shards_for_range t start finish)
+        in
+        let pos = Array.make (Array.length parts) 0 in
+        let acc = ref [] and n = ref 0 in
+        let rec merge () =
+            if limit = 0 || !n < limit then begin
+                let best = ref (-1) in
+                Array.iteri (fun i part ->
+                    if pos.(i) < Array.length part
+                        && (!best < 0
+                            || Dump.compare_key (fst part.(pos.(i)))
+                                   (fst parts.(!best).(pos.(!best))) < 0) then
+                        best := i) parts;
+                if !best >= 0 then begin
+                    acc := parts.(!best).(pos.(!best)) :: !acc;
+                    pos.(!best) <- pos.(!best) + 1;
+                    incr n;
+                    merge ()
+                end
+            end
+        in
+        merge ();
+        Array.of_list (List.rev !acc)
+
+    type cursor = {
+        cu_shard: shard;
+        cu_token: iter_token;
+        mutable cu_buf: (obj_key * obj_value) array;
+        mutable cu_pos: int;
+        mutable cu_more: bool;
+    }
+
+    (* Refills a cursor whose buffer is used up; false once it is exhausted. *)
+    let rec cursor_ready batch_size cu =
+        if cu.cu_pos < Array.length cu.cu_buf then true
+        else if not cu.cu_more then false
+        else begin
+            let more, kvs = iter_next cu.cu_shard.sh_conn cu.cu_token batch_size in
+            cu.cu_buf <- kvs;
+            cu.cu_pos <- 0;
+            cu.cu_more <- more;
+            cursor_ready batch_size cu
+        end
+
+    (* Calls f on every pair in [start, finish] across the shards, in key
+       order. The shards' iterators are started in parallel and merged as
+       they are consumed. *)
+    let iter_range ?(batch_size = 1024) f t start finish =
+        let finish_all cursors =
+            Array.iter (fun cu ->
+                if cu.cu_more then begin
+                    cu.cu_more <- false;
+                    try iter_finish cu.cu_shard.sh_conn cu.cu_token with _ -> ()
+                end) cursors
+        in
+        let wanted = shards_for_range t start finish in
+        (* Filled in as each shard's iterator starts, so that if another
+           shard fails to start, the ones already open can be finished. *)
+        let started = Array.make (Array.length wanted) None in
+        let cursors =
+            try
+                parallel (fun i ->
+                    let sh = t.shards.(wanted.(i)) in
+                    let token, more, kvs = iter_start sh.sh_conn sh.sh_collection start finish batch_size in
+                    let cu = { cu_shard = sh; cu_token = token; cu_buf = kvs; cu_pos = 0; cu_more = more } in
+                    started.(i) <- Some cu;
+                    cu) (Array.mapi (fun i _ -> i) wanted)
+            with e ->
+                Array.iter (function
+                    | Some cu -> finish_all [| cu |]
+                    | None -> ()) started;
+                raise e
+        in
+        let rec merge () =
+            let best = ref None in
+            Array.iter (fun cu ->
+                if cursor_ready batch_size cu then
+                    match !best with
+                    | Some b when Dump.compare_key (fst b.cu_buf.(b.cu_pos))
+                                      (fst cu.cu_buf.(cu.cu_pos)) <= 0 -> ()
+                    | _ -> best := Some cu) cursors;
+            match !best with
+            | None -> ()
+            | Some cu ->
+                let k, v = cu.cu_buf.(cu.cu_pos) in
+                cu.cu_pos <- cu.cu_pos + 1;
+                f k v;
+                merge ()
+        in
+        try merge () with e -> finish_all cursors; raise e
+end
+
+(* Re-issues a recorded trace against a target: a live connection, or an
+   in-memory stand-in for runs without Castle. Since traces keep only the
+   shape of keys and values, replay makes up keys and values of the
+   recorded sizes. *)
+module Replay = struct
+    type target = {
+        r_get: collection_id -> obj_key -> unit;
+        r_replace: collection_id -> obj_key -> string -> unit;
+        r_remove: collection_id -> obj_key -> unit;
+        r_multi_replace: collection_id -> (obj_key * string) array -> unit;
+        r_multi_remove: collection_id -> obj_key array -> unit;
+        r_multi_get: collection_id -> obj_key array -> unit;
+        r_get_slice: collection_id -> obj_key -> obj_key -> int -> unit;
+        r_iter_start: collection_id -> obj_key -> obj_key -> int -> iter_token;
+        r_iter_next: iter_token -> int -> unit;
+        r_iter_finish: iter_token -> unit;
+        (* Called once the stream replayed against this target is done. *)
+        r_close: unit -> unit;
+    }
+
+    type stats = {
+        replayed: int;
+        failed: int;
+        elapsed: float;
+    }
+
+    let of_connection connection = {
+        r_get = (fun c k -> ignore (get connection c k));
+        r_replace = (fun c k v -> replace connection c k v);
+        r_remove = (fun c k -> remove connection c k);
+        r_multi_replace = (fun c kvps -> multi_replace connection c kvps);
+        r_multi_remove = (fun c ks -> multi_remove connection c ks);
+        r_multi_get = (fun c ks -> ignore (multi_get connection c ks));
+        r_get_slice = (fun c start finish limit -> ignore (get_slice connection c start finish limit));
+        r_iter_start = (fun c start finish batch_size ->
+            let token, _, _ = iter_start connection c start finish batch_size in token);
+        r_iter_next = (fun t batch_size -> ignore (iter_next connection t batch_size));
+        r_iter_finish = (fun t -> iter_finish connection t);
+        r_close = (fun () -> ());
+    }
+
+    (* A target on a connection of its own, closed with the target. *)
+    let connected () =
+        let connection = connect () in
+        { (of_connection connection) with r_close = (fun () -> disconnect connection) }
+
+    (* A hash table standing in for libcastle; scans visit up to the
+       requested number of entries of the collection. The targets it hands
+       out share the table, so streams replayed against them see each
+       other's writes, as they would in Castle. *)
+    let in_memory () =
+        let table = Hashtbl.create 1024 in
+        let iterators = Hashtbl.create 16 in
+        let next_token = ref 0l in
+        let lock = Mutex.create () in
+        let locked f x =
+            Mutex.lock lock;
+            match f x with
+            | r -> Mutex.unlock lock; r
+            | exception e -> Mutex.unlock lock; raise e
+        in
+        let scan c limit =
+            let n = ref 0 in
+            try
+                Hashtbl.iter (fun (c', _) _ ->
+                    if c' = c then begin
+                        incr n;
+                        if limit > 0 && !n >= limit then raise Exit
+                    end) table
+            with Exit -> ()
+        in
+        let target = {
+            r_get = (fun c k -> locked (fun () -> ignore (Hashtbl.mem table (c, k))) ());
+            r_replace = (fun c k v -> locked (fun () -> Hashtbl.replace table (c, k) v) ());
+            r_remove = (fun c k -> locked (fun () -> Hashtbl.remove table (c, k)) ());
+            r_multi_replace = (fun c kvps -> locked (fun () ->
+                Array.iter (fun (k, v) -> Hashtbl.replace table (c, k) v) kvps) ());
+            r_multi_remove = (fun c ks -> locked (fun () ->
+                Array.iter (fun k -> Hashtbl.remove table (c, k)) ks) ());
+            r_multi_get = (fun c ks -> locked (fun () ->
+                Array.iter (fun k -> ignore (Hashtbl.mem table (c, k))) ks) ());
+            r_get_slice = (fun c _ _ limit -> locked (fun () -> scan c limit) ());
+            r_iter_start = (fun c _ _ batch_size -> locked (fun () ->
+                scan c batch_size;
+                next_token := Int32.succ !next_token;
+                Hashtbl.replace iterators !next_token c;
+                !next_token) ());
+            r_iter_next = (fun t batch_size ->
+                locked (fun () -> scan (Hashtbl.find iterators t) batch_size) ());
+            r_iter_finish = (fun t -> locked (fun () -> Hashtbl.remove iterators t) ());
+            r_close = (fun () -> ());
+        }
+        in
+        fun () -> target
+
+    let synthetic_key seq shape =
+        Array.mapi (fun i len ->
+            let d = sprintf "%d.%d." seq i in
+            if String.length d >= len then String.sub d 0 len
+            else d ^ String.make (len - String.length d) 'k') shape
+
+    (* Replays one stream's entries, each numbered by its place in the
+       trace, against target. Returns the number of calls that failed. *)
+    let replay_stream ~speed ~started ~t0 target entries =
+        let tokens = Hashtbl.create 16 in
+        let failed = ref 0 in
+        List.iter (fun (seq, e) ->
+            if speed > 0. then begin
+                let due = started +. (e.Trace.timestamp -. t0) /. speed in
+                let now = Unix.gettimeofday () in
+                if due > now then Thread.delay (due -. now)
+            end;
+            let shape = e.Trace.key_shape in
+            let key = synthetic_key seq shape in
+            let keys n = Array.init (max 1 n) (fun i -> synthetic_key (seq + i) shape) in
+            let unbounded = Array.make (Array.length shape) "" in
+            let c = e.Trace.collection in
+            (try begin
+                match e.Trace.op with
+                | Trace.Get -> target.r_get c key
+                | Trace.Replace -> target.r_replace c key (String.make e.Trace.value_size 'v')
+                | Trace.Remove -> target.r_remove c key
+                | Trace.Multi_replace ->
+                    let ks = keys e.Trace.count in
+                    let v = String.make (e.Trace.value_size / Array.length ks) 'v' in
+                    target.r_multi_replace c (Array.map (fun k -> (k, v)) ks)
+                | Trace.Multi_remove -> target.r_multi_remove c (keys e.Trace.count)
+                | Trace.Multi_get -> target.r_multi_get c (keys e.Trace.count)
+                | Trace.Get_slice -> target.r_get_slice c key unbounded e.Trace.count
+                | Trace.Iter_start ->
+                    let t = target.r_iter_start c key unbounded e.Trace.count in
+                    Hashtbl.replace tokens e.Trace.token t
+                | Trace.Iter_next -> target.r_iter_next (Hashtbl.find tokens c) e.Trace.count
+                | Trace.Iter_finish ->
+                    let t = Hashtbl.find tokens c in
+                    Hashtbl.remove tokens c;
+                    target.r_iter_finish t
+            end with _ -> incr failed)) entries;
+        !failed
+
+    (* Replays the trace in filename. Each stream of the trace, a thread of
+       the traced program, is replayed on a thread of its own against a
+       target of its own from new_target, so that the calls overlap as
+       they did when traced; connected gives each stream its own
+       connection. speed scales the recorded pacing: 1.0 replays at the
+       original rate, 2.0 twice as fast, and 0.0 (or less) issues each of
+       a stream's calls as soon as its previous one returns. *)
+    let run ?(speed = 1.0) new_target filename =
+        let streams = Hashtbl.create 16 in
+        let order = ref [] in
+        let seq = ref 0 and t0 = ref None in
+        Trace.iter (fun e ->
+            if !t0 = None then t0 := Some e.Trace.timestamp;
+            (try
+                let l = Hashtbl.find streams e.Trace.stream in
+                l := (!seq, e) :: !l
+            with Not_found ->
+                Hashtbl.replace streams e.Trace.stream (ref [(!seq, e)]);
+                order := e.Trace.stream :: !order);
+            incr seq) filename;
+        let t0 = match !t0 with Some t -> t | None -> 0. in
+        let started = Unix.gettimeofday () in
+        let lock = Mutex.create () in
+        let failed = ref 0 and failure = ref None in
+        let threads = List.map (fun stream ->
+            let entries = List.rev !(Hashtbl.find streams stream) in
+            Thread.create (fun () ->
+                try
+                    let target = new_target () in
+                    let n =
+                        match replay_stream ~speed ~started ~t0 target entries with
+                        | n -> target.r_close (); n
+                        | exception e -> target.r_close (); raise e
+                    in
+                    Mutex.lock lock;
+                    failed := !failed + n;
+                    Mutex.unlock lock
+                with e ->
+                    Mutex.lock lock;
+                    if !failure = None then failure := Some e;
+                    Mutex.unlock lock) ()) (List.rev !order)
+        in
+        List.iter Thread.join threads;
+        (match !failure with
+         | Some e -> raise e
+         | None -> ());
+        { replayed = !seq; failed = !failed; elapsed = Unix.gettimeofday () -. started }
+end
+
+(* Iterator batch sizes chosen from a byte budget and a latency target
+   instead of a fixed row count. After each batch the size is retuned from
+   the bytes per row and the time per row seen so far: small rows get large
+   batches, so round trips stop dominating, and fat rows get small ones, so
+   a batch never builds an oversized array. *)
+module Adaptive = struct
+    type t = {
+        byte_budget: int;
+        latency_target: float;
+        min_size: int;
+        max_size: int;
+        mutable size: int;
+        (* Moving average of the bytes in a row; 0. until a row is seen. *)
+        mutable row_bytes: float;
+    }
+
+    let create ?(initial = 64) ?(min_size = 1) ?(max_size = 65536) ~byte_budget ~latency_target () =
+        if min_size < 1 || max_size < min_size then invalid_arg "Castle.Adaptive.create";
+        {
+            byte_budget = byte_budget;
+            latency_target = latency_target;
+            min_size = min_size;
+            max_size = max_size;
+            size = max min_size (min max_size initial);
+            row_bytes = 0.;
+        }
+
+    let size t = t.size
+
+    let pair_bytes (k, v) =
+        Array.fold_left (fun n d -> n + String.length d) 0 k
+        + (match v with Value v -> String.length v | Tombstone -> 0)
+
+    (* Folds a batch that took elapsed seconds into the next batch size. The
+       size at most doubles or halves per batch, so one odd batch cannot
+       swing it far. *)
+    let observe t kvs elapsed =
+        let rows = Array.length kvs in
+        if rows > 0 then begin
+            let bytes = Array.fold_left (fun n kv -> n + pair_bytes kv) 0 kvs in
+            let sample = float_of_int bytes /. float_of_int rows in
+            t.row_bytes <-
+                if t.row_bytes = 0. then sample else 0.75 *. t.row_bytes +. 0.25 *. sample
+        end;
+        let by_bytes =
+            if t.row_bytes > 0. then int_of_float (float_of_int t.byte_budget /. t.row_bytes)
+            else max_int
+        in
+        let by_latency =
+            if rows = 0 || elapsed <= 0. then max_int
+            else int_of_float (float_of_int rows *. t.latency_target /. elapsed)
+        in
+        let wanted = min by_bytes by_latency in
+        let next = max (t.size / 2) (min (t.size * 2) wanted) in
+        t.size <- max t.min_size (min t.max_size next)
+
+    let iter_start connection t c start finish =
+        let t0 = Unix.gettimeofday () in
+        let (_, _, kvs) as r = iter_start connection c start finish t.size in
+        observe t kvs (Unix.gettimeofday () -. t0);
+        r
+
+    let iter_next connection t token =
+        let t0 = Unix.gettimeofday () in
+        let (_, kvs) as r = iter_next connection token t.size in
+        observe t kvs (Unix.gettimeofday () -. t0);
+        r
+end
+
+(* Typed keys and values. A codec describes a record of ints, floats and
+   fixed-width strings, field by field in declaration order; the C stubs
+   encode such records straight into the key and value buffers and decode
+   results straight out of libcastle's, with no intermediate strings. Keys
+   get one dimension per field, and ints and floats are encoded so that
+   Castle orders them numerically.
+
+   A codec is made from its fields and a sample record, which fixes its
+   type and must be laid out as the fields say. Every record encoded is
+   checked the same way, so a record that does not match its codec raises
+   Invalid_argument rather than being misread. *)
+module Codec = struct
+    type field =
+        | Int
+        | Float
+        (* A string of at most this many bytes, NUL-padded to the width;
+           trailing NULs are dropped again when decoding. *)
+        | Fixed of int
+
+    type 'a t = field array
+
+    external castle_codec_get : connection -> (int32 [@unboxed]) -> 'k t -> 'k -> 'v t -> 'v = "caml_castle_codec_get_byte" "caml_castle_codec_get"
+    external castle_codec_replace : connection -> (int32 [@unboxed]) -> 'k t -> 'k -> 'v t -> 'v -> unit = "caml_castle_codec_replace_byte" "caml_castle_codec_replace"
+    external castle_codec_remove : connection -> (int32 [@unboxed]) -> 'k t -> 'k -> unit = "caml_castle_codec_remove_byte" "caml_castle_codec_remove"
+    external castle_codec_encode_key : 'k t -> 'k -> string array = "caml_castle_codec_encode_key"
+    external castle_codec_decode_key : 'k t -> string array -> 'k = "caml_castle_codec_decode_key"
+    external castle_codec_decode_value : 'v t -> string -> 'v = "caml_castle_codec_decode_value"
+    external castle_codec_check : 'a t -> 'a -> unit = "caml_castle_codec_check"
+    external castle_codec_get_slice : connection -> (int32 [@unboxed]) -> 'k t -> 'k -> 'k -> 'v t -> (int [@untagged]) -> ('k * 'v) array = "caml_castle_codec_get_slice_byte" "caml_castle_codec_get_slice"
+    external castle_codec_iter_start : connection -> (int32 [@unboxed]) -> 'k t -> 'k -> 'k -> 'v t -> (int [@untagged]) -> int32 * bool * (('k * 'v) array) = "caml_castle_codec_iter_start_byte" "caml_castle_codec_iter_start"
+    external castle_codec_iter_next : connection -> (int32 [@unboxed]) -> 'k t -> 'v t -> (int [@untagged]) -> bool * (('k * 'v) array) = "caml_castle_codec_iter_next_byte" "caml_castle_codec_iter_next"
+
+    (* Decoding builds records shaped like sample, so it must be a value of
+       the record type the codec is for. *)
+    let make fields (sample : 'a) : 'a t =
+        if Array.length fields = 0 then invalid_arg "Castle.Codec.make: no fields";
+        Array.iter (function
+            | Fixed n when n <= 0 -> invalid_arg "Castle.Codec.make: Fixed width must be positive"
+            | _ -> ()) fields;
+        let codec = Array.copy fields in
+        castle_codec_check codec sample;
+        codec
+
+    let width = function Int | Float -> 8 | Fixed n -> n
+    let shape codec () = Array.map width codec
+    let size codec = Array.fold_left (fun n f -> n + width f) 0 codec
+
+    let get_untraced connection c kc k vc =
+        try Some (castle_codec_get connection c kc k vc)
+        with Not_found -> None
+
+    let get connection c kc k vc =
+        if not (Trace.recording ()) then get_untraced connection c kc k vc
+        else Trace.traced_shape Trace.Get c (shape kc) 0
+            (function
+                | Some _ -> (Trace.Done, size vc, 0l)
+                | None -> (Trace.Missing, 0, 0l))
+            (fun () -> get_untraced connection c kc k vc)
+
+    let replace connection c kc k vc v =
+        if not (Trace.recording ()) then castle_codec_replace connection c kc k vc v
+        else Trace.traced_shape Trace.Replace c (shape kc) 0 (Trace.finished (size vc))
+            (fun () -> castle_codec_replace connection c kc k vc v)
+
+    let remove connection c kc k =
+        if not (Trace.recording ()) then castle_codec_remove connection c kc k
+        else Trace.traced_shape Trace.Remove c (shape kc) 0 (Trace.finished 0)
+            (fun () -> castle_codec_remove connection c kc k)
+
+    (* Ranges run from one key record to another, both included, and come
+       back already decoded, straight from libcastle's result list. *)
+    let pairs_size vc pairs = Array.length pairs * size vc
+
+    (* 'limit' means the maximum number of pairs to return. 0 means unlimited. *)
+    let get_slice connection c kc start finish vc limit =
+        if not (Trace.recording ()) then castle_codec_get_slice connection c kc start finish vc limit
+        else Trace.traced_shape Trace.Get_slice c (shape kc) limit
+            (fun pairs -> (Trace.Done, pairs_size vc pairs, 0l))
+            (fun () -> castle_codec_get_slice connection c kc start finish vc limit)
+
+    let iter_start connection c kc start finish vc batch_size =
+        if not (Trace.recording ()) then
+            castle_codec_iter_start connection c kc start finish vc batch_size
+        else Trace.traced_shape Trace.Iter_start c (shape kc) batch_size
+            (fun (token, _, pairs) -> (Trace.Done, pairs_size vc pairs, token))
+            (fun () -> castle_codec_iter_start connection c kc start finish vc batch_size)
+
+    let iter_next connection t kc vc batch_size =
+        if not (Trace.recording ()) then castle_codec_iter_next connection t kc vc batch_size
+        else Trace.traced_shape Trace.Iter_next t (fun () -> [||]) batch_size
+            (fun (_, pairs) -> (Trace.Done, pairs_size vc pairs, 0l))
+            (fun () -> castle_codec_iter_next connection t kc vc batch_size)
+
+    (* Conversions to and from plain keys and values, for use with the
+       untyped calls. *)
+    let encode_key kc k = castle_codec_encode_key kc k
+    let decode_key kc k = castle_codec_decode_key kc k
+    let decode_value vc v =
+        match v with
+        | Value v -> castle_codec_decode_value vc v
+        | Tombstone -> raise Not_found
+end
+
+(* Reads with a deadline and optional hedging, over a pool of connections.
+   Each pooled connection has a long-lived worker thread that runs the reads
+   queued for it. If a read is still outstanding after the hedge delay (a
+   percentile of recent read latencies) the same read is also queued on a
+   second free connection, and whichever answers first wins. If neither has
+   answered by the deadline the caller gets Deadline_exceeded; a read stuck
+   in libcastle cannot be interrupted, so its connection stays out of the
+   pool until it returns. One timer thread per pool wakes waiting callers at
+   their hedge and deadline times. *)
+module Hedged = struct
+    type worker = {
+        w_jobs: (connection -> unit) Queue.t;
+        w_ready: Condition.t;
+    }
+
+    type pool = {
+        p_conns: connection array;
+        p_workers: worker array;
+        (* Guards everything below, and every worker's queue. *)
+        p_lock: Mutex.t;
+        (* Which connections are not in use. *)
+        p_free: bool array;
+        (* Broadcast when a read finishes or a wakeup time passes. *)
+        p_changed: Condition.t;
+        (* Times at which p_changed must be broadcast; the timer thread
+           sleeps on p_wake_r until the earliest of them. *)
+        mutable p_wakeups: float list;
+        p_wake_r: Unix.file_descr;
+        p_wake_w: Unix.file_descr;
+        mutable p_timer: Thread.t option;
+        mutable p_closed: bool;
+        p_percentile: float;
+        (* Recent successful read latencies, as a ring. *)
+        p_latencies: float array;
+        mutable p_next: int;
+        mutable p_seen: int;
+        mutable p_delay: float option;
+    }
+
+    type 'a call = {
+        mutable c_result: [ `Ok of 'a | `Error of exn ] option;
+    }
+
+    (* The hedge delay is recomputed every this many reads. *)
+    let resample = 64
+
+    (* Runs jobs from the worker's queue until the pool is closed, then
+       disconnects the worker's connection. *)
+    let rec work pool i =
+        let w = pool.p_workers.(i) in
+        Mutex.lock pool.p_lock;
+        while Queue.is_empty w.w_jobs && not pool.p_closed do
+            Condition.wait w.w_ready pool.p_lock
+        done;
+        let job = if Queue.is_empty w.w_jobs then None else Some (Queue.pop w.w_jobs) in
+        Mutex.unlock pool.p_lock;
+        match job with
+        | Some job -> job pool.p_conns.(i); work pool i
+        | None -> (try disconnect pool.p_conns.(i) with _ -> ())
+
+    (* Broadcasts p_changed as each wakeup time passes. *)
+    let rec time pool =
+        Mutex.lock pool.p_lock;
+        let now = Unix.gettimeofday () in
+        let due, later = List.partition (fun t -> t <= now) pool.p_wakeups in
+        pool.p_wakeups <- later;
+        if due <> [] then Condition.broadcast pool.p_changed;
+        let next = List.fold_left min infinity later in
+        let closed = pool.p_closed in
+        Mutex.unlock pool.p_lock;
+        if not closed then begin
+            let timeout = if next = infinity then -1.0 else max 0. (next -. now) in
+            (match Unix.select [pool.p_wake_r] [] [] timeout with
+             | (_ :: _, _, _) -> ignore (Unix.read pool.p_wake_r (Bytes.create 64) 0 64)
+             | _ -> ()
+             | exception Unix_error (EINTR, _, _) -> ());
+            time pool
+        end
+
+    let create ?(hedge_percentile = 0.95) ?(window = 1024) size =
+        if size < 1 || window < 1 then invalid_arg "Castle.Hedged.create";
+        (* Also rejects nan. *)
+        if not (hedge_percentile >= 0. && hedge_percentile <= 1.) then
+            invalid_arg "Castle.Hedged.create: hedge_percentile";
+        let conns = ref [] in
+        (try
+            for _i = 1 to size do
+                conns := connect () :: !conns
+            done
+        with e ->
+            List.iter disconnect !conns;
+            raise e);
+        let r, w = Unix.pipe () in
+        (* The wakeup byte is only a nudge; a full pipe already wakes the timer. *)
+        Unix.set_nonblock w;
+        let pool = {
+            p_conns = Array.of_list !conns;
+            p_workers = Array.init size (fun _ ->
+                { w_jobs = Queue.create (); w_ready = Condition.create () });
+            p_lock = Mutex.create ();
+            p_free = Array.make size true;
+            p_changed = Condition.create ();
+            p_wakeups = [];
+            p_wake_r = r;
+            p_wake_w = w;
+            p_timer = None;
+            p_closed = false;
+            p_percentile = hedge_percentile;
+            p_latencies = Array.make window 0.;
+            p_next = 0;
+            p_seen = 0;
+            p_delay = None;
+        } in
+        for i = 0 to size - 1 do
+            ignore (Thread.create (work pool) i)
+        done;
+        pool.p_timer <- Some (Thread.create time pool);
+        pool
+
+    let wake_timer pool =
+        try ignore (Unix.write_substring pool.p_wake_w "x" 0 1)
+        with Unix_error ((EAGAIN | EWOULDBLOCK), _, _) -> ()
+
+    (* Each worker disconnects once its queue is empty, so a connection
+       held by a read stuck in Castle is released when that read returns. *)
+    let close pool =
+        Mutex.lock pool.p_lock;
+        let closed = pool.p_closed in
+        pool.p_closed <- true;
+        Array.iter (fun w -> Condition.signal w.w_ready) pool.p_workers;
+        Condition.broadcast pool.p_changed;
+        Mutex.unlock pool.p_lock;
+        if not closed then begin
+            wake_timer pool;
+            (match pool.p_timer with Some t -> Thread.join t | None -> ());
+            Unix.close pool.p_wake_r;
+            Unix.close pool.p_wake_w
+        end
+
+    (* The functions below are called with p_lock held. *)
+
+    let add_wakeup pool t =
+        if t < List.fold_left min infinity pool.p_wakeups then wake_timer pool;
+        pool.p_wakeups <- t :: pool.p_wakeups
+
+    let remove_wakeup pool t =
+        let rec remove = function
+            | [] -> []
+            | t' :: rest when t' = t -> rest
+            | t' :: rest -> t' :: remove rest
+        in
+        pool.p_wakeups <- remove pool.p_wakeups
+
+    let take_free pool =
+        let rec scan i =
+            if i = Array.length pool.p_free then None
+            else if pool.p_free.(i) then (pool.p_free.(i) <- false; Some i)
+            else scan (i + 1)
+        in
+        scan 0
+
+    let observe pool latency =
+        let window = Array.length pool.p_latencies in
+        pool.p_latencies.(pool.p_next) <- latency;
+        pool.p_next <- (pool.p_next + 1) mod window;
+        pool.p_seen <- pool.p_seen + 1;
+        if pool.p_seen mod resample = 0 then begin
+            let sorted = Array.sub pool.p_latencies 0 (min pool.p_seen window) in
+            let n = Array.length sorted in
+            Array.sort compare sorted;
+            pool.p_delay <-
+                Some sorted.(min (n - 1) (int_of_float (pool.p_percentile *. float_of_int n)))
+        end
+
+    (* Queues f on connection i; the job hands the connection back and
+       records the first answer in call. *)
+    let submit pool call i f =
+        let w = pool.p_workers.(i) in
+        Queue.push (fun conn ->
+            let t0 = Unix.gettimeofday () in
+            let r = try `Ok (f conn) with e -> `Error e in
+            let latency = Unix.gettimeofday () -. t0 in
+            Mutex.lock pool.p_lock;
+            pool.p_free.(i) <- true;
+            (match r with `Ok _ -> observe pool latency | `Error _ -> ());
+            (match call.c_result with
+             | None -> call.c_result <- Some r
+             | Some _ -> ());
+            Condition.broadcast pool.p_changed;
+            Mutex.unlock pool.p_lock) w.w_jobs;
+        Condition.signal w.w_ready
+
+    let run ?deadline ?(hedge = true) pool f =
+        let started = Unix.gettimeofday () in
+        let deadline_at = match deadline with Some d -> started +. d | None -> infinity in
+        let call = { c_result = None } in
+        Mutex.lock pool.p_lock;
+        if pool.p_closed then begin
+            Mutex.unlock pool.p_lock;
+            invalid_arg "Castle.Hedged: pool closed"
+        end;
+        let hedge_at =
+            match hedge, pool.p_delay with
+            | true, Some d -> started +. d
+            | _ -> infinity
+        in
+        let wakeups = List.filter (fun t -> t < infinity) [deadline_at; hedge_at] in
+        List.iter (add_wakeup pool) wakeups;
+        (* Reads stuck in Castle keep their connections, so waiting for one
+           without a deadline could block for good. *)
+        let rec first () =
+            match take_free pool with
+            | Some i -> submit pool call i f; answer false
+            | None when Unix.gettimeofday () >= deadline_at || pool.p_closed ->
+                `Error Deadline_exceeded
+            | None -> Condition.wait pool.p_changed pool.p_lock; first ()
+        and answer hedged =
+            match call.c_result with
+            | Some r -> r
+            | None ->
+                let now = Unix.gettimeofday () in
+                if now >= deadline_at then `Error Deadline_exceeded
+                else if not hedged && now >= hedge_at then begin
+                    (match take_free pool with
+                     | Some i -> submit pool call i f
+                     | None -> ());
+                    answer true
+                end else begin
+                    Condition.wait pool.p_changed pool.p_lock;
+                    answer hedged
+                end
+        in
+        let r = first () in
+        List.iter (remove_wakeup pool) wakeups;
+        Mutex.unlock pool.p_lock;
+        match r with
+        | `Ok v -> v
+        | `Error e -> raise e
+
+    (* deadline is in seconds from the call; hedging is on by default once
+       enough reads have been seen to estimate the delay. *)
+    let get ?deadline ?hedge pool c k =
+        run ?deadline ?hedge pool (fun conn -> get conn c k)
+
+    let get_slice ?deadline ?hedge pool c start finish limit =
+        run ?deadline ?hedge pool (fun conn -> get_slice conn c start finish limit)
+end
+
+(* Secondary indexes kept in step with a primary collection. An index lives
+   in a collection of its own; each entry's key is the row's index key
+   followed by the dimensions of its primary key, so that rows may share an
+   index key, and its value is empty. Index entries are written before the
+   primary rows they point at, and lookups check every row they find
+   against the index key, so a lookup never returns a row the index no
+   longer describes. *)
+module Index = struct
+    type index = {
+        i_collection: collection_id;
+        (* The index key of a row, or None to leave the row out. *)
+        i_extract: obj_key -> string -> obj_key option;
+    }
+
+    type t = {
+        x_conn: connection;
+        x_primary: collection_id;
+        (* Number of dimensions in the primary's keys. *)
+        x_dims: int;
+        x_indexes: index list;
+    }
+
+    let define ~collection ~extract = { i_collection = collection; i_extract = extract }
+
+    let create connection ~primary ~dims indexes =
+        { x_conn = connection; x_primary = primary; x_dims = dims; x_indexes = indexes }
+
+    let entry ik k = Array.append ik k
+
+    let extract ix k = function
+        | Value v -> ix.i_extract k v
+        | Tombstone -> None
+
+    (* Writes a batch of rows (with distinct keys) and the index changes they
+       cause: each index gets one multi_replace for its new entries, then
+       the rows go to the primary in a multi_replace of their own, and only
+       then does each index get one multi_remove for its stale entries. A
+       failure part way therefore leaves at worst stale entries behind,
+       which lookup filters out, and never a row its index cannot find. *)
+    let replace_batch t kvs =
+        let olds = multi_get t.x_conn t.x_primary (Array.map fst kvs) in
+        let changes = List.map (fun ix ->
+            let removes = ref [] and adds = ref [] in
+            Array.iteri (fun i (k, v) ->
+                let before = extract ix k olds.(i) and after = ix.i_extract k v in
+                if before <> after then begin
+                    (match before with
+                     | Some ik -> removes := entry ik k :: !removes
+                     | None -> ());
+                    (match after with
+                     | Some ik -> adds := (entry ik k, "") :: !adds
+                     | None -> ())
+                end) kvs;
+            (ix, Array.of_list (List.rev !removes), Array.of_list (List.rev !adds)))
+            t.x_indexes
+        in
+        List.iter (fun (ix, _, adds) ->
+            if adds <> [||] then multi_replace t.x_conn ix.i_collection adds) changes;
+        multi_replace t.x_conn t.x_primary kvs;
+        List.iter (fun (ix, removes, _) ->
+            if removes <> [||] then multi_remove t.x_conn ix.i_collection removes) changes
+
+    let replace t k v = replace_batch t [| (k, v) |]
+
+    (* The row goes first, for the same reason as in replace_batch. *)
+    let remove t k =
+        let old = get t.x_conn t.x_primary k in
+        remove t.x_conn t.x_primary k;
+        List.iter (fun ix ->
+            match extract ix k old with
+            | Some ik -> remove t.x_conn ix.i_collection (entry ik k)
+            | None -> ()) t.x_indexes
+
+    (* The rows whose index key under ix is ik, fetched from the primary
+       with multi_get. 'limit' bounds the index entries read; 0 means
+       unlimited. *)
+    let lookup ?(limit = 0) t ix ik =
+        let unbounded = Array.make t.x_dims "" in
+        let entries =
+            get_slice t.x_conn ix.i_collection (entry ik unbounded) (entry ik unbounded) limit
+        in
+        let n = Array.length ik in
+        let keys = Array.map (fun (e, _) -> Array.sub e n (Array.length e - n)) entries in
+        let values = multi_get t.x_conn t.x_primary keys in
+        let rows = ref [] in
+        for i = Array.length keys - 1 downto 0 do
+            match values.(i) with
+            | Value v when ix.i_extract keys.(i) v = Some ik -> rows := (keys.(i), v) :: !rows
+            | _ -> ()
+        done;
+        Array.of_list !rows
+
+    (* Sampling the primary for rebuild's split points. The first key
+       dimension is treated as a number, its first sample_width bytes read
+       big-endian, and divided into cells. A cell is probed with a
+       get_slice of at most probe_rows rows: fewer means the cell's row
+       count is known exactly; otherwise how far into the cell the rows
+       reach gives an estimate. The fullest cells are halved and probed
+       again until the estimates are fine enough to cut between, so keys
+       sharing a long prefix, as ASCII keys do, are still spread evenly. *)
+    let sample_width = 8
+    let probe_rows = 64
+
+    type cell = {
+        (* Bounds, padded to sample_width; the last cell's c_hi is all 0xff
+           and stands for no bound at all. *)
+        c_lo: string;
+        c_hi: string;
+        c_rows: float;
+        c_exact: bool;
+    }
+
+    let pad s =
+        if String.length s >= sample_width then String.sub s 0 sample_width
+        else s ^ String.make (sample_width - String.length s) '\000'
+
+    let strip s =
+        let n = ref (String.length s) in
+        while !n > 0 && s.[!n - 1] = '\000' do decr n done;
+        String.sub s 0 !n
+
+    (* How far s lies from lo towards hi, between 0 and 1, judged on the
+       bytes after their common prefix. *)
+    let fraction lo hi s =
+        let c = ref 0 in
+        while !c < sample_width && lo.[!c] = hi.[!c] do incr c done;
+        let v x =
+            let r = ref 0. and scale = ref 1. in
+            for j = !c to min (sample_width - 1) (!c + 5) do
+                scale := !scale /. 256.;
+                r := !r +. float_of_int (Char.code x.[j]) *. !scale
+            done;
+            !r
+        in
+        let span = v hi -. v lo in
+        if span <= 0. then 1. else max 0. (min 1. ((v s -. v lo) /. span))
+
+    let midpoint lo hi =
+        let sum = Array.make (sample_width + 1) 0 and carry = ref 0 in
+        for j = sample_width - 1 downto 0 do
+            let d = Char.code lo.[j] + Char.code hi.[j] + !carry in
+            sum.(j + 1) <- d land 0xff;
+            carry := d lsr 8
+        done;
+        sum.(0) <- !carry;
+        let rem = ref 0 in
+        for j = 0 to sample_width do
+            let d = !rem * 256 + sum.(j) in
+            sum.(j) <- d lsr 1;
+            rem := d land 1
+        done;
+        String.init sample_width (fun j -> Char.chr sum.(j + 1))
+
+    (* Up to partitions - 1 first-dimension values that cut the primary
+       into ranges of roughly equal size. *)
+    let split_points t ~partitions =
+        let top = String.make sample_width '\255' in
+        let bound d = Array.init t.x_dims (fun i -> if i = 0 then d else "") in
+        let measure lo hi =
+            let finish = if hi = top then "" else strip hi in
+            let rows =
+                get_slice t.x_conn t.x_primary (bound (strip lo)) (bound finish) probe_rows
+            in
+            let n = Array.length rows in
+            if n < probe_rows then
+                { c_lo = lo; c_hi = hi; c_rows = float_of_int n; c_exact = true }
+            else begin
+                let f = fraction lo hi (pad (fst rows.(n - 1)).(0)) in
+                { c_lo = lo; c_hi = hi;
+                  c_rows = float_of_int n /. max f (1. /. float_of_int probe_rows);
+                  c_exact = false }
+            end
+        in
+        let total cells = List.fold_left (fun n c -> n +. c.c_rows) 0. cells in
+        let cells = ref [measure (pad "") top] and probes = ref 1 in
+        let refining = ref true in
+        while !refining && !probes + 2 <= 16 * partitions do
+            let fine = total !cells /. float_of_int (4 * partitions) in
+            let fullest = List.fold_left (fun best c ->
+                if c.c_exact || c.c_rows <= fine || midpoint c.c_lo c.c_hi = c.c_lo then best
+                else match best with
+                    | Some b when b.c_rows >= c.c_rows -> best
+                    | _ -> Some c) None !cells
+            in
+            match fullest with
+            | None -> refining := false
+            | Some c ->
+                let mid = midpoint c.c_lo c.c_hi in
+                cells := List.concat (List.map (fun c' ->
+                    if c' == c then [measure c.c_lo mid; measure mid c.c_hi] else [c']) !cells);
+                probes := !probes + 2
+        done;
+        let all = total !cells in
+        let splits = ref [] and acc = ref 0. and next = ref 1 in
+        List.iter (fun c ->
+            acc := !acc +. c.c_rows;
+            while !next < partitions
+                  && !acc >= all *. float_of_int !next /. float_of_int partitions do
+                let s = strip c.c_hi in
+                (match !splits with
+                 | s' :: _ when s' = s -> ()
+                 | _ -> if c.c_hi <> top && s <> "" then splits := s :: !splits);
+                incr next
+            done) !cells;
+        Array.of_list (List.rev !splits)
+
+    (* Derives every entry of ix from a scan of the primary, split into
+       ranges of the first key dimension that are scanned in parallel, each
+       on its own connection. The ranges are chosen by sampling the primary
+       (see split_points), and there may be fewer than 'partitions' of them
+       if the primary is small. Entries are only ever added, so rebuild
+       into an empty index collection. *)
+    let rebuild ?(partitions = 4) ?(batch_size = 1024) t ix =
+        if partitions < 1 then invalid_arg "Castle.Index.rebuild";
+        let splits = if partitions = 1 then [||] else split_points t ~partitions in
+        let ranges = Array.length splits + 1 in
+        (* Range p runs from split p - 1 up to and including split p; rows
+           whose first dimension is a split point are indexed twice, which
+           is harmless. *)
+        let bounds p =
+            let start = Array.make t.x_dims "" and finish = Array.make t.x_dims "" in
+            if p > 0 then start.(0) <- splits.(p - 1);
+            if p < ranges - 1 then finish.(0) <- splits.(p);
+            start, finish
+        in
+        let scan p =
+            let conn = connect () in
+            let batch = ref [] and n = ref 0 in
+            let flush () =
+                if !n > 0 then begin
+                    multi_replace conn ix.i_collection (Array.of_list !batch);
+                    batch := [];
+                    n := 0
+                end
+            in
+            let add kvs =
+                Array.iter (fun (k, v) ->
+                    match extract ix k v with
+                    | Some ik -> batch := (entry ik k, "") :: !batch; incr n
+                    | None -> ()) kvs;
+                if !n >= batch_size then flush ()
+            in
+            let start, finish = bounds p in
+            let more = ref false in
+            (try
+                let token, m, kvs = iter_start conn t.x_primary start finish batch_size in
+                more := m;
+                (try
+                    add kvs;
+                    while !more do
+                        let m, kvs = iter_next conn token batch_size in
+                        more := m;
+                        add kvs
+                    done
+                with e ->
+                    if !more then (try iter_finish conn token with _ -> ());
+                    raise e);
+                flush ()
+            with e ->
+                disconnect conn;
+                raise e);
+            disconnect conn
+        in
+        ignore (parallel scan (Array.init ranges (fun p -> p)))
+
+    (* Starts rebuild on a thread of its own. The returned function waits
+       for it to finish, re-raising anything it failed with. *)
+    let rebuild_in_background ?partitions ?batch_size t ix =
+        let failure = ref None in
+        let thread = Thread.create (fun () ->
+            try rebuild ?partitions ?batch_size t ix
+            with e -> failure := Some e) ()
+        in
+        fun () ->
+            Thread.join thread;
+            match !failure with
+            | Some e -> raise e
+            | None -> ()
+end
+
+(* Tenant vertrees and their upkeep. Each tenant gets a vertree of its own
+   with a collection attached at the root version. Provisioning, expiry
+   and compaction each go through control_batch, one ioctl per tenant or
+   version, serialized on the one connection. *)
+module Lifecycle = struct
+    type tenant = {
+        tenant_name: string;
+        tenant_vertree: int32;
+        tenant_version: int32;
+        tenant_collection: int32;
+    }
+
+    type t = {
+        l_conn: connection;
+        (* create_with_opts hands back a new vertree's root version, not
+           the vertree's id. Nothing in these bindings can look the id up,
+           so the caller supplies the mapping from outside (see the .mli). *)
+        l_vertree_of_version: int32 -> int32;
+        l_lock: Mutex.t;
+        (* vertree -> (interval, next due), in seconds *)
+        l_compactions: (int32, float * float) Hashtbl.t;
+    }
+
+    let create ~vertree_of_version connection =
+        { l_conn = connection;
+          l_vertree_of_version = vertree_of_version;
+          l_lock = Mutex.create ();
+          l_compactions = Hashtbl.create 16 }
+
+    (* keys.(i) paired with the error of each result i that failed. *)
+    let failures keys results =
+        let l = ref [] in
+        for i = Array.length results - 1 downto 0 do
+            match results.(i) with
+            | Control_failed e -> l := (keys.(i), e) :: !l
+            | Control_done | Control_id _ -> ()
+        done;
+        !l
+
+    (* The ids returned by the ops that succeeded, in order. *)
+    let ids results =
+        Array.fold_right (fun r l ->
+            match r with
+            | Control_id id -> id :: l
+            | Control_done | Control_failed _ -> l) results []
+
+    (* Raises the first failure among results as a Unix_error, once undo
+       has run. *)
+    let check what args undo results =
+        Array.iteri (fun i r ->
+            match r with
+            | Control_failed e -> undo (); raise (Unix_error (e, what, args.(i)))
+            | Control_done | Control_id _ -> ()) results
+
+    let schedule_compaction t ~vertree ~every =
+        if every <= 0. then invalid_arg "Castle.Lifecycle.schedule_compaction";
+        Mutex.lock t.l_lock;
+        Hashtbl.replace t.l_compactions vertree (every, Unix.gettimeofday () +. every);
+        Mutex.unlock t.l_lock
+
+    let unschedule_compaction t ~vertree =
+        Mutex.lock t.l_lock;
+        Hashtbl.remove t.l_compactions vertree;
+        Mutex.unlock t.l_lock
+
+    (* Creates a vertree per name and attaches a collection of that name at
+       its root, optionally setting a time-to-delete policy and scheduling
+       compaction. If any step fails, whatever was created is destroyed
+       again and the first failure is raised. *)
+    let provision ?tdp ?compact_every t ~size ~opts names =
+        let conn = t.l_conn in
+        let destroy versions =
+            ignore (control_batch conn (Array.of_list
+                (List.map (fun v -> Destroy_vertree (t.l_vertree_of_version v)) versions)))
+        in
+        let created = control_batch conn (Array.map (fun _ -> Create (size, opts)) names) in
+        check "create_with_opts" names (fun () -> destroy (ids created)) created;
+        let versions = Array.of_list (ids created) in
+        let attached =
+            control_batch conn (Array.mapi (fun i v -> Collection_attach (v, names.(i))) versions)
+        in
+        let undo () =
+            ignore (control_batch conn (Array.of_list
+                (List.map (fun c -> Collection_detach c) (ids attached))));
+            destroy (Array.to_list versions)
+        in
+        check "collection_attach" names undo attached;
+        let collections = Array.of_list (ids attached) in
+        let tenants = Array.mapi (fun i v ->
+            { tenant_name = names.(i);
+              tenant_vertree = t.l_vertree_of_version v;
+              tenant_version = v;
+              tenant_collection = collections.(i) }) versions
+        in
+        (match tdp with
+         | Some seconds ->
+             check "vertree_tdp_set" names undo (control_batch conn
+                 (Array.map (fun tn -> Vertree_tdp_set (tn.tenant_vertree, seconds)) tenants))
+         | None -> ());
+        (match compact_every with
+         | Some every ->
+             Array.iter (fun tn ->
+                 schedule_compaction t ~vertree:tn.tenant_vertree ~every) tenants
+         | None -> ());
+        tenants
+
+    (* Detaches each tenant's collection and destroys its vertree. Returns
+       the tenants for which either failed. *)
+    let decommission t tenants =
+        Array.iter (fun tn -> unschedule_compaction t ~vertree:tn.tenant_vertree) tenants;
+        let ops = Array.append
+            (Array.map (fun tn -> Collection_detach tn.tenant_collection) tenants)
+            (Array.map (fun tn -> Destroy_vertree tn.tenant_vertree) tenants)
+        in
+        failures (Array.append tenants tenants) (control_batch t.l_conn ops)
+
+    (* Sets the time-to-delete policy of each vertree. Returns the vertrees
+       it could not be set on. *)
+    let set_tdp t ~seconds vertrees =
+        failures vertrees
+            (control_batch t.l_conn (Array.map (fun v -> Vertree_tdp_set (v, seconds)) vertrees))
+
+    (* Deletes versions, as nightly cleanup does. Returns those that could
+       not be deleted. *)
+    let expire t versions =
+        failures versions
+            (control_batch t.l_conn (Array.map (fun v -> Delete_version v) versions))
+
+    (* Compacts every vertree that is due, and schedules each one's next
+       compaction. Returns the vertrees whose compaction failed. *)
+    let tick t =
+        let now = Unix.gettimeofday () in
+        Mutex.lock t.l_lock;
+        let due = Hashtbl.fold (fun v (every, next) l ->
+            if next <= now then (v, every) :: l else l) t.l_compactions []
+        in
+        List.iter (fun (v, every) ->
+            Hashtbl.replace t.l_compactions v (every, now +. every)) due;
+        Mutex.unlock t.l_lock;
+        let vertrees = Array.of_list (List.map fst due) in
+        failures vertrees
+            (control_batch t.l_conn (Array.map (fun v -> Vertree_compact v) vertrees))
+
+    (* Runs tick every 'period' seconds on a thread of its own, passing each
+       failure to on_failure. The returned function stops the thread and
+       waits for it. *)
+    let run_in_background ?(period = 60.) ?(on_failure = fun _ _ -> ()) t =
+        let r, w = Unix.pipe () in
+        let thread = Thread.create (fun () ->
+            let rec loop () =
+                List.iter (fun (v, e) -> on_failure v e) (tick t);
+                match Unix.select [r] [] [] period with
+                | [], _, _ -> loop ()
+                | _ -> ()
+                | exception Unix_error (EINTR, _, _) -> loop ()
+            in
+            loop ()) ()
+        in
+        fun () ->
+            ignore (Unix.write_substring w "x" 0 1);
+            Thread.join thread;
+            Unix.close r;
+            Unix.close w
+end
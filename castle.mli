@@ -16,14 +16,71 @@ type merge_cfg = {
   m_data_ext_type : rda_type;
   m_bandwidth : int32;
 }
+type control_op =
+  | Clone of int32
+  | Delete_version of int32
+  | Create of int64 * int64
+  | Collection_attach of int32 * string
+  | Collection_detach of int32
+  | Collection_snapshot of int32
+  | Vertree_compact of int32
+  | Destroy_vertree of int32
+  | Vertree_tdp_set of int32 * int64
+type control_result =
+  | Control_done
+  | Control_id of int32
+  | Control_failed of Unix.error
 val connect : unit -> connection
 val disconnect : connection -> unit
 val connection_fd : connection -> Unix.file_descr
+type scratch_stats = {
+  high_water : int;
+  capacity : int;
+  grows : int;
+  fallbacks : int;
+}
+val scratch_stats : connection -> scratch_stats
 exception Invalid_reply of string
 exception Invalid_iterator
 exception Castle_not_running
+exception Deadline_exceeded
+module Trace :
+  sig
+    type op =
+        Get
+      | Replace
+      | Remove
+      | Get_slice
+      | Iter_start
+      | Iter_next
+      | Iter_finish
+      | Multi_replace
+      | Multi_remove
+      | Multi_get
+    type status = Done | Missing | Failed
+    type entry = {
+      op : op;
+      status : status;
+      collection : int32;
+      token : int32;
+      stream : int;
+      key_shape : int array;
+      value_size : int;
+      count : int;
+      timestamp : float;
+      latency : float;
+    }
+    val start : string -> unit
+    val stop : unit -> unit
+    val recording : unit -> bool
+    val iter : (entry -> unit) -> string -> unit
+  end
 val get :
   connection -> FSTypes2.collection_id -> FSTypes2.obj_key -> FSTypes2.obj_value
+val multi_get :
+  ?value_size:int ->
+  connection ->
+  FSTypes2.collection_id -> FSTypes2.obj_key array -> FSTypes2.obj_value array
 val get_slice :
   connection ->
   FSTypes2.collection_id ->
@@ -34,6 +91,8 @@ val replace :
 val multi_replace :
   connection -> FSTypes2.collection_id -> (FSTypes2.obj_key * string) array -> unit
 val remove : connection -> FSTypes2.collection_id -> FSTypes2.obj_key -> unit
+val multi_remove :
+  connection -> FSTypes2.collection_id -> FSTypes2.obj_key array -> unit
 val iter_start :
   connection ->
   FSTypes2.collection_id ->
@@ -71,6 +130,10 @@ val collection_reattach :
 val collection_detach : connection -> collection:int32 -> unit
 val collection_take_snapshot : connection -> collection:int32 -> int32
 val environment_set : connection -> FSTypes2.environment_var_id -> string -> unit
+(* Issues the ops one ioctl at a time, in order, on this connection; it
+   saves only the runtime-lock round trips between them, not any ioctls.
+   Every op is attempted, and result i is the outcome of op i. *)
+val control_batch : connection -> control_op array -> control_result array
 val fault : connection -> fault_id:int32 -> fault_arg:int32 -> unit
 val slave_evacuate : connection -> disk:int32 -> force:int32 -> unit
 val slave_scan : connection -> id:int32 -> unit
@@ -78,3 +141,236 @@ val thread_priority : connection -> nice_value:int32 -> unit
 val ctrl_prog_deregister : connection -> shutdown:bool -> int32
 val merge_start : connection -> merge_cfg:merge_cfg -> int32
 val vertree_tdp_set : connection -> vertree:int32 -> seconds:int64 -> unit
+module Snapshot :
+  sig
+    type t
+    val take :
+      ?quiesce:((unit -> unit) -> unit) ->
+      connection -> collections:FSTypes2.collection_id list -> t
+    val release : t -> unit
+    val with_snapshot :
+      ?quiesce:((unit -> unit) -> unit) ->
+      connection -> collections:FSTypes2.collection_id list -> (t -> 'a) -> 'a
+    val collection : t -> FSTypes2.collection_id -> FSTypes2.collection_id
+    val version : t -> FSTypes2.collection_id -> FSTypes2.version_id
+    val get : t -> FSTypes2.collection_id -> FSTypes2.obj_key -> FSTypes2.obj_value
+    val get_slice :
+      t ->
+      FSTypes2.collection_id ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key -> int -> (FSTypes2.obj_key * FSTypes2.obj_value) array
+    val iter_start :
+      t ->
+      FSTypes2.collection_id ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key ->
+      int ->
+      FSTypes2.iter_token * bool * ((FSTypes2.obj_key * FSTypes2.obj_value) array)
+    val iter_next :
+      t ->
+      FSTypes2.iter_token ->
+      int ->
+      bool * ((FSTypes2.obj_key * FSTypes2.obj_value) array)
+    val iter_finish : t -> FSTypes2.iter_token -> unit
+  end
+module Dump :
+  sig
+    type t
+    val export :
+      ?batch_size:int ->
+      ?block_size:int ->
+      connection ->
+      FSTypes2.collection_id ->
+      FSTypes2.obj_key -> FSTypes2.obj_key -> string -> int
+    val write :
+      ?block_size:int ->
+      string -> (FSTypes2.obj_key * FSTypes2.obj_value) array -> int
+    val open_file : string -> t
+    val length : t -> int
+    val get : t -> FSTypes2.obj_key -> FSTypes2.obj_value
+    val get_slice :
+      t ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key -> int -> (FSTypes2.obj_key * FSTypes2.obj_value) array
+    val iter_range :
+      (FSTypes2.obj_key -> string -> unit) ->
+      t -> FSTypes2.obj_key -> FSTypes2.obj_key -> unit
+    val iter : (FSTypes2.obj_key -> string -> unit) -> t -> unit
+    val import :
+      ?batch_size:int -> connection -> FSTypes2.collection_id -> t -> unit
+  end
+module Sharded :
+  sig
+    type routing = Hash of int | Range of int * string array
+    type t
+    val of_collections :
+      routing:routing -> (connection * FSTypes2.collection_id) array -> t
+    (* create_with_opts returns a vertree's root version, and nothing in
+       these bindings can map that to the vertree's id. vertree_of_version
+       must come from whatever assigns vertree ids on the caller's side,
+       such as Castle's administrative tooling; it is only used to destroy
+       the vertrees of a create that fails part way. *)
+    val create :
+      routing:routing ->
+      name:string ->
+      size:int64 ->
+      opts:int64 -> shards:int -> vertree_of_version:(int32 -> int32) -> t
+    val close : t -> unit
+    val collections : t -> FSTypes2.collection_id array
+    val shard_index : t -> FSTypes2.obj_key -> int
+    val get : t -> FSTypes2.obj_key -> FSTypes2.obj_value
+    val replace : t -> FSTypes2.obj_key -> string -> unit
+    val remove : t -> FSTypes2.obj_key -> unit
+    val multi_replace : t -> (FSTypes2.obj_key * string) array -> unit
+    val multi_get :
+      ?value_size:int ->
+      t -> FSTypes2.obj_key array -> FSTypes2.obj_value array
+    val get_slice :
+      t ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key -> int -> (FSTypes2.obj_key * FSTypes2.obj_value) array
+    val iter_range :
+      ?batch_size:int ->
+      (FSTypes2.obj_key -> FSTypes2.obj_value -> unit) ->
+      t -> FSTypes2.obj_key -> FSTypes2.obj_key -> unit
+  end
+module Replay :
+  sig
+    type target = {
+      r_get : FSTypes2.collection_id -> FSTypes2.obj_key -> unit;
+      r_replace : FSTypes2.collection_id -> FSTypes2.obj_key -> string -> unit;
+      r_remove : FSTypes2.collection_id -> FSTypes2.obj_key -> unit;
+      r_multi_replace :
+        FSTypes2.collection_id -> (FSTypes2.obj_key * string) array -> unit;
+      r_multi_remove : FSTypes2.collection_id -> FSTypes2.obj_key array -> unit;
+      r_multi_get : FSTypes2.collection_id -> FSTypes2.obj_key array -> unit;
+      r_get_slice :
+        FSTypes2.collection_id ->
+        FSTypes2.obj_key -> FSTypes2.obj_key -> int -> unit;
+      r_iter_start :
+        FSTypes2.collection_id ->
+        FSTypes2.obj_key -> FSTypes2.obj_key -> int -> FSTypes2.iter_token;
+      r_iter_next : FSTypes2.iter_token -> int -> unit;
+      r_iter_finish : FSTypes2.iter_token -> unit;
+      r_close : unit -> unit;
+    }
+    type stats = { replayed : int; failed : int; elapsed : float; }
+    val of_connection : connection -> target
+    val connected : unit -> target
+    val in_memory : unit -> unit -> target
+    val run : ?speed:float -> (unit -> target) -> string -> stats
+  end
+module Adaptive :
+  sig
+    type t
+    val create :
+      ?initial:int ->
+      ?min_size:int ->
+      ?max_size:int -> byte_budget:int -> latency_target:float -> unit -> t
+    val size : t -> int
+    val observe :
+      t -> (FSTypes2.obj_key * FSTypes2.obj_value) array -> float -> unit
+    val iter_start :
+      connection ->
+      t ->
+      FSTypes2.collection_id ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key ->
+      FSTypes2.iter_token * bool * ((FSTypes2.obj_key * FSTypes2.obj_value) array)
+    val iter_next :
+      connection ->
+      t ->
+      FSTypes2.iter_token ->
+      bool * ((FSTypes2.obj_key * FSTypes2.obj_value) array)
+  end
+module Codec :
+  sig
+    type field = Int | Float | Fixed of int
+    type 'a t
+    val make : field array -> 'a -> 'a t
+    val get :
+      connection -> FSTypes2.collection_id -> 'k t -> 'k -> 'v t -> 'v option
+    val replace :
+      connection -> FSTypes2.collection_id -> 'k t -> 'k -> 'v t -> 'v -> unit
+    val remove : connection -> FSTypes2.collection_id -> 'k t -> 'k -> unit
+    val get_slice :
+      connection ->
+      FSTypes2.collection_id -> 'k t -> 'k -> 'k -> 'v t -> int -> ('k * 'v) array
+    val iter_start :
+      connection ->
+      FSTypes2.collection_id ->
+      'k t -> 'k -> 'k -> 'v t -> int -> FSTypes2.iter_token * bool * (('k * 'v) array)
+    val iter_next :
+      connection ->
+      FSTypes2.iter_token -> 'k t -> 'v t -> int -> bool * (('k * 'v) array)
+    val encode_key : 'k t -> 'k -> FSTypes2.obj_key
+    val decode_key : 'k t -> FSTypes2.obj_key -> 'k
+    val decode_value : 'v t -> FSTypes2.obj_value -> 'v
+  end
+module Hedged :
+  sig
+    type pool
+    val create : ?hedge_percentile:float -> ?window:int -> int -> pool
+    val close : pool -> unit
+    val get :
+      ?deadline:float ->
+      ?hedge:bool ->
+      pool -> FSTypes2.collection_id -> FSTypes2.obj_key -> FSTypes2.obj_value
+    val get_slice :
+      ?deadline:float ->
+      ?hedge:bool ->
+      pool ->
+      FSTypes2.collection_id ->
+      FSTypes2.obj_key ->
+      FSTypes2.obj_key -> int -> (FSTypes2.obj_key * FSTypes2.obj_value) array
+  end
+module Index :
+  sig
+    type index
+    type t
+    val define :
+      collection:FSTypes2.collection_id ->
+      extract:(FSTypes2.obj_key -> string -> FSTypes2.obj_key option) ->
+      index
+    val create :
+      connection -> primary:FSTypes2.collection_id -> dims:int -> index list -> t
+    val replace_batch : t -> (FSTypes2.obj_key * string) array -> unit
+    val replace : t -> FSTypes2.obj_key -> string -> unit
+    val remove : t -> FSTypes2.obj_key -> unit
+    val lookup :
+      ?limit:int ->
+      t -> index -> FSTypes2.obj_key -> (FSTypes2.obj_key * string) array
+    val rebuild : ?partitions:int -> ?batch_size:int -> t -> index -> unit
+    val rebuild_in_background :
+      ?partitions:int -> ?batch_size:int -> t -> index -> (unit -> unit)
+  end
+module Lifecycle :
+  sig
+    type tenant = {
+      tenant_name : string;
+      tenant_vertree : int32;
+      tenant_version : int32;
+      tenant_collection : int32;
+    }
+    type t
+    (* vertree_of_version maps a new vertree's root version, as returned
+       by create_with_opts, to the vertree's id. These bindings have no
+       call that produces it, so it must come from the caller, for instance
+       from Castle's administrative tooling. tdp, compaction and destroy
+       all act on the ids it returns, so a wrong mapping acts on the wrong
+       vertree. *)
+    val create : vertree_of_version:(int32 -> int32) -> connection -> t
+    val schedule_compaction : t -> vertree:int32 -> every:float -> unit
+    val unschedule_compaction : t -> vertree:int32 -> unit
+    val provision :
+      ?tdp:int64 ->
+      ?compact_every:float ->
+      t -> size:int64 -> opts:int64 -> string array -> tenant array
+    val decommission : t -> tenant array -> (tenant * Unix.error) list
+    val set_tdp : t -> seconds:int64 -> int32 array -> (int32 * Unix.error) list
+    val expire : t -> int32 array -> (int32 * Unix.error) list
+    val tick : t -> (int32 * Unix.error) list
+    val run_in_background :
+      ?period:float ->
+      ?on_failure:(int32 -> Unix.error -> unit) -> t -> (unit -> unit)
+  end
@@ -33,10 +33,75 @@
 #define debug(_f, _a...)  (printf(_f, ##_a))
 #endif
 
-#define Castle_val(v) (*(castle_connection **) Data_custom_val(v))
+struct caml_castle_connection;
+
+/* A growable buffer for the keys, values and requests the stubs build on
+   every call, reused from call to call instead of allocated each time. It
+   is a castle shared buffer: the kernel only takes the keys and values of
+   batched requests from memory registered with the connection. */
+struct castle_scratch {
+    struct caml_castle_connection *owner;
+    char                          *buf;
+    size_t                         size;
+    size_t                         high_water;    /* Largest reservation seen. */
+    size_t                         window_high;   /* Largest this window. */
+    unsigned                       window_calls;
+    uintnat                        grows;
+    int                            in_use;
+    struct castle_scratch         *next;          /* Next spare. */
+};
+
+#define SCRATCH_MIN_SIZE    4096
+/* An arena is kept however large it grew, unless SCRATCH_WINDOW calls in a
+   row needed less than 1/SCRATCH_SLACK of it. */
+#define SCRATCH_WINDOW      256
+#define SCRATCH_SLACK       4
+
+/* The custom block points at this rather than embedding it, since the GC
+   may move the block while a call has the runtime lock released. */
+struct caml_castle_connection {
+    castle_connection     *conn;
+    struct castle_scratch  scratch;
+    /* Arenas for calls that found scratch taken by another thread, kept
+       for the next such call. */
+    struct castle_scratch *spares;
+    uintnat                fallbacks;
+};
+
+#define Connection_val(v) (*(struct caml_castle_connection **) Data_custom_val(v))
+#define Castle_val(v) (Connection_val(v)->conn)
+
+static void scratch_release(struct castle_scratch *s)
+{
+    if (s->buf)
+        castle_shared_buffer_destroy(s->owner->conn, s->buf, s->size);
+    s->buf = NULL;
+    s->size = 0;
+}
+
+/* Gives back every arena's buffer, which must be done while the connection
+   is still open. */
+static void scratch_release_all(struct caml_castle_connection *c)
+{
+    struct castle_scratch *s;
+
+    scratch_release(&c->scratch);
+    for (s = c->spares; s; s = s->next)
+        scratch_release(s);
+}
 
 void caml_castle_finalize(value connection) {
-  castle_free(Castle_val(connection));
+  struct caml_castle_connection *c = Connection_val(connection);
+  struct castle_scratch *s;
+
+  scratch_release_all(c);
+  castle_free(c->conn);
+  while ((s = c->spares))
+  {
+      c->spares = s->next;
+      free(s);
+  }
+  free(c);
 }
 
 struct custom_operations castle_ops = {
@@ -90,6 +155,87 @@ static void copy_ocaml_key_to_buffer(value key_value, void *buffer, uint32_t len
     CAMLreturn0;
 }
 
+/* Claims a scratch arena for the duration of one call: the connection's,
+   or a spare if another thread is mid-call on the connection. The claim
+   and scratch_put both run with the runtime lock held, which is what keeps
+   in_use and the spares consistent between threads. */
+static struct castle_scratch *scratch_get(value connection)
+{
+    struct caml_castle_connection *c = Connection_val(connection);
+    struct castle_scratch *s;
+
+    if (!c->scratch.in_use)
+        s = &c->scratch;
+    else
+    {
+        c->fallbacks++;
+        s = c->spares;
+        if (s)
+            c->spares = s->next;
+        else
+        {
+            s = calloc(1, sizeof(*s));
+            if (!s)
+                caml_raise_out_of_memory();
+            s->owner = c;
+        }
+    }
+    s->in_use = 1;
+
+    return s;
+}
+
+/* Returns at least len bytes of scratch, or NULL if no shared buffer that
+   large could be had. The previous contents are not kept. */
+static void *scratch_reserve(struct castle_scratch *s, size_t len)
+{
+    size_t size;
+
+    if (len > s->high_water)
+        s->high_water = len;
+    if (len > s->window_high)
+        s->window_high = len;
+
+    if (len > s->size)
+    {
+        size = s->size ? s->size : SCRATCH_MIN_SIZE;
+        while (size < len)
+            size *= 2;
+
+        scratch_release(s);
+        if (castle_shared_buffer_create(s->owner->conn, &s->buf, size))
+        {
+            s->buf = NULL;
+            return NULL;
+        }
+        s->size = size;
+        s->grows++;
+    }
+
+    return s->buf;
+}
+
+static void scratch_put(struct castle_scratch *s)
+{
+    struct caml_castle_connection *c = s->owner;
+
+    s->in_use = 0;
+
+    if (++s->window_calls >= SCRATCH_WINDOW)
+    {
+        if (s->size > SCRATCH_MIN_SIZE && s->window_high * SCRATCH_SLACK < s->size)
+            scratch_release(s);
+        s->window_calls = 0;
+        s->window_high = 0;
+    }
+
+    if (s != &c->scratch)
+    {
+        s->next = c->spares;
+        c->spares = s;
+    }
+}
+
 static void get_key_length(value key, uint32_t *length_out)
 {
     CAMLparam1(key);
@@ -121,17 +267,27 @@ CAMLprim value caml_castle_connect(value unit)
     CAMLparam1(unit);
     CAMLlocal1(connection);
 
+    struct caml_castle_connection *c;
     castle_connection *conn;
     int ret;
 
     debug("fs_connect entered\n");
 
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        caml_raise_out_of_memory();
+
     ret = castle_connect(&conn);
     if (ret)
+    {
+        free(c);
         unix_error(-ret, "castle_connect", Nothing);
+    }
+    c->conn = conn;
+    c->scratch.owner = c;
 
-    connection = caml_alloc_custom(&castle_ops, sizeof(conn), 1, 1);
-    Castle_val(connection) = conn;
+    connection = caml_alloc_custom(&castle_ops, sizeof(c), 1, 1);
+    Connection_val(connection) = c;
 
     debug("fs_connect exiting\n");
 
@@ -147,6 +303,7 @@ CAMLprim void caml_castle_disconnect(value connection)
 
     conn = Castle_val(connection);
 
+    scratch_release_all(Connection_val(connection));
     castle_disconnect(conn);
 
     debug("fs_disconnect exiting\n");
@@ -154,35 +311,53 @@ CAMLprim void caml_castle_disconnect(value connection)
     CAMLreturn0;
 }
 
-#define MAX_GET_SIZE 512
-CAMLprim value caml_castle_get(value connection, value collection, value key_value)
+/* Gets one key with castle_get, which allocates the value for the caller
+   to free. The key is built in scratch, released again before returning. */
+static int get_one(value connection, uint32_t collection, value key_value, char **val, uint32_t *val_len)
 {
-    CAMLparam3(connection, collection, key_value);
-    CAMLlocal2(result, not_found);
+    CAMLparam2(connection, key_value);
 
     int ret;
-    uint32_t key_len, val_len, collection_id;
+    uint32_t key_len;
     castle_connection *conn;
+    struct castle_scratch *scratch;
     castle_key *key;
-    char *val;
-
-    debug("fs_get entered\n");
 
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    collection_id = Int32_val(collection);
-
     get_key_length(key_value, &key_len);
-    key = malloc(key_len);
-    if (!key) caml_failwith("Error allocating key");
+    scratch = scratch_get(connection);
+    key = scratch_reserve(scratch, key_len);
+    if (!key)
+    {
+        scratch_put(scratch);
+        caml_failwith("Error allocating key");
+    }
     copy_ocaml_key_to_buffer(key_value, key, key_len, EMPTY_MEANS_EMPTY);
 
     enter_blocking_section();
-    ret = castle_get(conn, collection_id, key, &val, &val_len);
+    ret = castle_get(conn, collection, key, val, val_len);
     leave_blocking_section();
 
-    free(key);
+    scratch_put(scratch);
+
+    CAMLreturnT(int, ret);
+}
+
+#define MAX_GET_SIZE 512
+CAMLprim value caml_castle_get(value connection, int32_t collection, value key_value)
+{
+    CAMLparam2(connection, key_value);
+    CAMLlocal2(result, not_found);
+
+    int ret;
+    uint32_t val_len;
+    char *val;
+
+    debug("fs_get entered\n");
+
+    ret = get_one(connection, collection, key_value, &val, &val_len);
 
     if (ret)
     {
@@ -220,13 +395,19 @@ CAMLprim value caml_castle_get(value connection, value collection, value key_val
     CAMLreturn(result);
 }
 
-CAMLprim void caml_castle_replace(value connection, value collection, value key_value, value val_value)
+CAMLprim value caml_castle_get_byte(value connection, value collection, value key_value)
+{
+    return caml_castle_get(connection, Int32_val(collection), key_value);
+}
+
+CAMLprim void caml_castle_replace(value connection, int32_t collection, value key_value, value val_value)
 {
-    CAMLparam4(connection, collection, key_value, val_value);
+    CAMLparam3(connection, key_value, val_value);
 
     int ret;
     uint32_t key_len, val_len, collection_id;
     castle_connection *conn;
+    struct castle_scratch *scratch;
     castle_key *key;
     void *buf;
     char *val;
@@ -236,14 +417,16 @@ CAMLprim void caml_castle_replace(value connection, value collection, value key_
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    collection_id = Int32_val(collection);
+    collection_id = collection;
 
     get_key_length(key_value, &key_len);
     val_len = caml_string_length(val_value);
 
-    buf = malloc(key_len + val_len);
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, key_len + val_len);
     if (!buf)
     {
+        scratch_put(scratch);
         debug("Could not alloc buffer.\n");
         caml_failwith("Could not alloc buffer.");
     }
@@ -256,7 +439,7 @@ CAMLprim void caml_castle_replace(value connection, value collection, value key_
     enter_blocking_section();
     ret = castle_replace(conn, collection_id, key, val, val_len);
     leave_blocking_section();
-    free(buf);
+    scratch_put(scratch);
     if (ret)
     {
         debug("Got error %d - '%s'", ret, strerror(ret));
@@ -266,13 +449,20 @@ CAMLprim void caml_castle_replace(value connection, value collection, value key_
     CAMLreturn0;
 }
 
-CAMLprim void caml_castle_remove(value connection, value collection, value key_value)
+CAMLprim value caml_castle_replace_byte(value connection, value collection, value key_value, value val_value)
+{
+    caml_castle_replace(connection, Int32_val(collection), key_value, val_value);
+    return Val_unit;
+}
+
+CAMLprim void caml_castle_remove(value connection, int32_t collection, value key_value)
 {
-    CAMLparam3(connection, collection, key_value);
+    CAMLparam2(connection, key_value);
 
     int ret;
     uint32_t key_len, collection_id;
     castle_connection *conn;
+    struct castle_scratch *scratch;
     castle_key *key;
 
     debug("fs_remove entered\n");
@@ -280,13 +470,15 @@ CAMLprim void caml_castle_remove(value connection, value collection, value key_v
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    collection_id = Int32_val(collection);
+    collection_id = collection;
 
     get_key_length(key_value, &key_len);
 
-    key = malloc(key_len);
+    scratch = scratch_get(connection);
+    key = scratch_reserve(scratch, key_len);
     if (!key)
     {
+        scratch_put(scratch);
         debug("Could not alloc buffer.\n");
         caml_failwith("Could not alloc buffer.");
     }
@@ -296,7 +488,7 @@ CAMLprim void caml_castle_remove(value connection, value collection, value key_v
     enter_blocking_section();
     ret = castle_remove(conn, collection_id, key);
     leave_blocking_section();
-    free(key);
+    scratch_put(scratch);
     if (ret)
     {
         debug("Got error %d - '%s'", ret, strerror(ret));
@@ -306,6 +498,354 @@ CAMLprim void caml_castle_remove(value connection, value collection, value key_v
     CAMLreturn0;
 }
 
+CAMLprim value caml_castle_remove_byte(value connection, value collection, value key_value)
+{
+    caml_castle_remove(connection, Int32_val(collection), key_value);
+    return Val_unit;
+}
+
+#define ALIGN_UP(_n, _a) (((_n) + (_a) - 1) & ~((size_t)(_a) - 1))
+
+/* Replaces a whole array of (key, value) pairs with a single batched
+   submission. The kernel only takes the keys and values of ring requests
+   from a buffer registered with the connection, so all of them are laid
+   out in the scratch arena, which is a castle shared buffer. Raises the
+   error of the first request that failed, if any did. */
+CAMLprim void caml_castle_multi_replace(value connection, int32_t collection, value kvs)
+{
+    CAMLparam2(connection, kvs);
+    CAMLlocal3(kv, key_value, val_value);
+
+    int ret;
+    uint32_t i, nr_kvs, key_len;
+    size_t resps_off, keys_off, vals_off, vals_len = 0;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_request *reqs;
+    castle_response *resps;
+    char *keys, *vals;
+
+    debug("fs_multi_replace entered\n");
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    nr_kvs = Wosize_val(kvs);
+    if (nr_kvs == 0)
+        CAMLreturn0;
+
+    /* Requests, then responses, then the keys, each padded to keep the
+       next aligned, and finally the values, which need no alignment. */
+    resps_off = ALIGN_UP(nr_kvs * sizeof(reqs[0]), __alignof__(castle_response));
+    keys_off = ALIGN_UP(resps_off + nr_kvs * sizeof(resps[0]), __alignof__(castle_key));
+    vals_off = keys_off;
+    for (i = 0; i < nr_kvs; i++)
+    {
+        kv = Field(kvs, i);
+        get_key_length(Field(kv, 0), &key_len);
+        vals_off += ALIGN_UP(key_len, __alignof__(castle_key));
+        vals_len += caml_string_length(Field(kv, 1));
+    }
+
+    scratch = scratch_get(connection);
+    reqs = scratch_reserve(scratch, vals_off + vals_len);
+    if (!reqs)
+    {
+        scratch_put(scratch);
+        debug("Could not alloc buffer.\n");
+        caml_failwith("Could not alloc buffer.");
+    }
+    resps = (castle_response *)((char *)reqs + resps_off);
+    keys = (char *)reqs + keys_off;
+    vals = (char *)reqs + vals_off;
+
+    for (i = 0; i < nr_kvs; i++)
+    {
+        uint32_t val_len;
+        castle_key *key;
+
+        kv = Field(kvs, i);
+        key_value = Field(kv, 0);
+        val_value = Field(kv, 1);
+        val_len = caml_string_length(val_value);
+
+        get_key_length(key_value, &key_len);
+        key = (castle_key *)keys;
+        copy_ocaml_key_to_buffer(key_value, key, key_len, EMPTY_MEANS_EMPTY);
+        keys += ALIGN_UP(key_len, __alignof__(castle_key));
+        memcpy(vals, String_val(val_value), val_len);
+
+        castle_replace_prepare(&reqs[i], collection, key, key_len, vals, val_len,
+                               CASTLE_RING_FLAG_NONE);
+        vals += val_len;
+    }
+
+    enter_blocking_section();
+    ret = castle_request_do_blocking_multi(conn, reqs, resps, nr_kvs);
+    leave_blocking_section();
+
+    /* A successful submission can still carry failed replaces. */
+    for (i = 0; !ret && i < nr_kvs; i++)
+        ret = resps[i].err;
+
+    scratch_put(scratch);
+
+    if (ret)
+    {
+        debug("Got error %d - '%s'", ret, strerror(ret));
+        unix_error(-ret, "multi_replace", Nothing);
+    }
+
+    debug("fs_multi_replace exiting\n");
+
+    CAMLreturn0;
+}
+
+CAMLprim value caml_castle_multi_replace_byte(value connection, value collection, value kvs)
+{
+    caml_castle_multi_replace(connection, Int32_val(collection), kvs);
+    return Val_unit;
+}
+
+/* Removes a whole array of keys with a single batched submission. As in
+   caml_castle_multi_replace, the keys must be in a castle shared buffer,
+   so they are laid out in the scratch arena. */
+CAMLprim void caml_castle_multi_remove(value connection, int32_t collection, value keys_value)
+{
+    CAMLparam2(connection, keys_value);
+    CAMLlocal1(key_value);
+
+    int ret;
+    uint32_t i, nr_keys, key_len;
+    size_t resps_off, keys_off, buf_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_request *reqs;
+    castle_response *resps;
+    char *keys;
+
+    debug("fs_multi_remove entered\n");
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    nr_keys = Wosize_val(keys_value);
+    if (nr_keys == 0)
+        CAMLreturn0;
+
+    resps_off = ALIGN_UP(nr_keys * sizeof(reqs[0]), __alignof__(castle_response));
+    keys_off = ALIGN_UP(resps_off + nr_keys * sizeof(resps[0]), __alignof__(castle_key));
+    buf_len = keys_off;
+    for (i = 0; i < nr_keys; i++)
+    {
+        get_key_length(Field(keys_value, i), &key_len);
+        buf_len += ALIGN_UP(key_len, __alignof__(castle_key));
+    }
+
+    scratch = scratch_get(connection);
+    reqs = scratch_reserve(scratch, buf_len);
+    if (!reqs)
+    {
+        scratch_put(scratch);
+        debug("Could not alloc buffer.\n");
+        caml_failwith("Could not alloc buffer.");
+    }
+    resps = (castle_response *)((char *)reqs + resps_off);
+    keys = (char *)reqs + keys_off;
+
+    for (i = 0; i < nr_keys; i++)
+    {
+        castle_key *key;
+
+        key_value = Field(keys_value, i);
+        get_key_length(key_value, &key_len);
+        key = (castle_key *)keys;
+        copy_ocaml_key_to_buffer(key_value, key, key_len, EMPTY_MEANS_EMPTY);
+        keys += ALIGN_UP(key_len, __alignof__(castle_key));
+
+        castle_remove_prepare(&reqs[i], collection, key, key_len, CASTLE_RING_FLAG_NONE);
+    }
+
+    enter_blocking_section();
+    ret = castle_request_do_blocking_multi(conn, reqs, resps, nr_keys);
+    leave_blocking_section();
+
+    for (i = 0; !ret && i < nr_keys; i++)
+        ret = resps[i].err;
+
+    scratch_put(scratch);
+
+    if (ret)
+    {
+        debug("Got error %d - '%s'", ret, strerror(ret));
+        unix_error(-ret, "multi_remove", Nothing);
+    }
+
+    debug("fs_multi_remove exiting\n");
+
+    CAMLreturn0;
+}
+
+CAMLprim value caml_castle_multi_remove_byte(value connection, value collection, value keys_value)
+{
+    caml_castle_multi_remove(connection, Int32_val(collection), keys_value);
+    return Val_unit;
+}
+
+/* What one get of a multi_get came to. */
+struct multi_get_outcome {
+    int      err;
+    uint32_t length;
+};
+
+/* Gets a whole array of keys with a single batched submission, laid out as
+   in caml_castle_multi_replace, with a value_size slot per key where the
+   values would go. A value larger than its slot comes back with its full
+   length and is fetched again with castle_get. The outcomes and values are
+   staged in an OCaml string allocated before scratch is claimed, so that
+   no scratch is held while the results are built. Returns an obj_value
+   per key, Tombstone for those that are missing. */
+CAMLprim value caml_castle_multi_get(value connection, int32_t collection, value keys_value, intnat value_size)
+{
+    CAMLparam2(connection, keys_value);
+    CAMLlocal4(staging, results, result, field_v);
+
+    int ret;
+    uint32_t i, nr_keys, key_len, slot;
+    size_t resps_off, keys_off, vals_off, staged_off;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_request *reqs;
+    castle_response *resps;
+    struct multi_get_outcome *outcomes;
+    char *keys, *vals;
+
+    debug("fs_multi_get entered\n");
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    nr_keys = Wosize_val(keys_value);
+    if (nr_keys == 0)
+        CAMLreturn(Atom(0));
+    if (value_size < 0 || value_size > UINT32_MAX)
+        caml_invalid_argument("Castle.multi_get: value_size");
+    slot = value_size;
+
+    resps_off = ALIGN_UP(nr_keys * sizeof(reqs[0]), __alignof__(castle_response));
+    keys_off = ALIGN_UP(resps_off + nr_keys * sizeof(resps[0]), __alignof__(castle_key));
+    vals_off = keys_off;
+    for (i = 0; i < nr_keys; i++)
+    {
+        get_key_length(Field(keys_value, i), &key_len);
+        vals_off += ALIGN_UP(key_len, __alignof__(castle_key));
+    }
+
+    /* The outcomes, then a slot per key. */
+    staged_off = nr_keys * sizeof(*outcomes);
+    staging = caml_alloc_string(staged_off + (size_t)nr_keys * slot);
+
+    scratch = scratch_get(connection);
+    reqs = scratch_reserve(scratch, vals_off + (size_t)nr_keys * slot);
+    if (!reqs)
+    {
+        scratch_put(scratch);
+        debug("Could not alloc buffer.\n");
+        caml_failwith("Could not alloc buffer.");
+    }
+    resps = (castle_response *)((char *)reqs + resps_off);
+    keys = (char *)reqs + keys_off;
+    vals = (char *)reqs + vals_off;
+
+    for (i = 0; i < nr_keys; i++)
+    {
+        castle_key *key;
+
+        get_key_length(Field(keys_value, i), &key_len);
+        key = (castle_key *)keys;
+        copy_ocaml_key_to_buffer(Field(keys_value, i), key, key_len, EMPTY_MEANS_EMPTY);
+        keys += ALIGN_UP(key_len, __alignof__(castle_key));
+
+        castle_get_prepare(&reqs[i], collection, key, key_len, vals + (size_t)i * slot, slot,
+                           CASTLE_RING_FLAG_NONE);
+    }
+
+    enter_blocking_section();
+    ret = castle_request_do_blocking_multi(conn, reqs, resps, nr_keys);
+    leave_blocking_section();
+
+    if (!ret)
+    {
+        outcomes = (struct multi_get_outcome *)Bytes_val(staging);
+        for (i = 0; i < nr_keys; i++)
+        {
+            outcomes[i].err = resps[i].err;
+            outcomes[i].length = resps[i].length > UINT32_MAX ? UINT32_MAX : resps[i].length;
+            if (!outcomes[i].err && outcomes[i].length <= slot)
+                memcpy(Bytes_val(staging) + staged_off + (size_t)i * slot,
+                       vals + (size_t)i * slot, outcomes[i].length);
+        }
+    }
+
+    scratch_put(scratch);
+
+    if (ret)
+    {
+        debug("Got error %d - '%s'", ret, strerror(ret));
+        unix_error(-ret, "multi_get", Nothing);
+    }
+
+    /* Tombstone is the constant constructor, Value of string the block. */
+    results = caml_alloc(nr_keys, 0);
+    for (i = 0; i < nr_keys; i++)
+    {
+        struct multi_get_outcome outcome = ((struct multi_get_outcome *)Bytes_val(staging))[i];
+
+        if (outcome.err == 0 && outcome.length > slot)
+        {
+            char *val;
+            uint32_t val_len;
+
+            outcome.err = get_one(connection, collection, Field(keys_value, i), &val, &val_len);
+            if (!outcome.err)
+            {
+                field_v = caml_alloc_string(val_len);
+                memcpy(Bytes_val(field_v), val, val_len);
+                free(val);
+            }
+        }
+        else if (outcome.err == 0)
+        {
+            field_v = caml_alloc_string(outcome.length);
+            memcpy(Bytes_val(field_v), Bytes_val(staging) + staged_off + (size_t)i * slot,
+                   outcome.length);
+        }
+
+        if (outcome.err == -ENOENT)
+            result = Val_int(0);
+        else if (outcome.err)
+        {
+            debug("Got error %d - '%s'", outcome.err, strerror(outcome.err));
+            unix_error(-outcome.err, "multi_get", Nothing);
+        }
+        else
+        {
+            result = caml_alloc(1, 0);
+            Store_field(result, 0, field_v);
+        }
+        Store_field(results, i, result);
+    }
+
+    debug("fs_multi_get exiting\n");
+
+    CAMLreturn(results);
+}
+
+CAMLprim value caml_castle_multi_get_byte(value connection, value collection, value keys_value, value value_size)
+{
+    return caml_castle_multi_get(connection, Int32_val(collection), keys_value, Int_val(value_size));
+}
+
 static value castle_key_to_ocaml(castle_key *key)
 {
     CAMLparam0();
@@ -382,9 +922,9 @@ static value castle_kv_list_to_ocaml(struct castle_key_value_list *kv_list)
     CAMLreturn(arr);
 }
 
-CAMLprim value caml_castle_iter_start(value connection, value collection, value start_key, value end_key, value size)
+CAMLprim value caml_castle_iter_start(value connection, int32_t collection, value start_key, value end_key, intnat size)
 {
-    CAMLparam5(connection, collection, start_key, end_key, size);
+    CAMLparam3(connection, start_key, end_key);
     CAMLlocal3(token_out, arr, ret_tuple);
 
     int ret, more;
@@ -392,6 +932,7 @@ CAMLprim value caml_castle_iter_start(value connection, value collection, value
     void *start_key_buf, *end_key_buf;
     struct castle_key_value_list *kv_list;
     castle_connection *conn;
+    struct castle_scratch *scratch;
     castle_interface_token_t token;
 
     debug("fs_iter_start entered\n");
@@ -399,19 +940,21 @@ CAMLprim value caml_castle_iter_start(value connection, value collection, value
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    buf_length = Int_val(size);
-    collection_id = Int32_val(collection);
+    buf_length = size;
+    collection_id = collection;
 
     get_key_length(start_key, &start_key_len);
     get_key_length(end_key, &end_key_len);
 
-    start_key_buf = malloc(start_key_len);
-    end_key_buf = malloc(end_key_len);
-    if (!start_key_buf || !end_key_buf)
+    scratch = scratch_get(connection);
+    start_key_buf = scratch_reserve(scratch, start_key_len + end_key_len);
+    if (!start_key_buf)
     {
+        scratch_put(scratch);
         debug("Could not alloc buffer.\n");
         caml_failwith("Could not alloc buffer.");
     }
+    end_key_buf = (char *)start_key_buf + start_key_len;
 
     copy_ocaml_key_to_buffer(start_key, start_key_buf, start_key_len, EMPTY_MEANS_NEGATIVE_INFINITY);
     copy_ocaml_key_to_buffer(end_key, end_key_buf, end_key_len, EMPTY_MEANS_POSITIVE_INFINITY);
@@ -427,8 +970,7 @@ CAMLprim value caml_castle_iter_start(value connection, value collection, value
                             &more);
     leave_blocking_section();
 
-    free(start_key_buf);
-    free(end_key_buf);
+    scratch_put(scratch);
 
     if (ret)
         unix_error(-ret, "iter_start", Nothing);
@@ -445,9 +987,14 @@ CAMLprim value caml_castle_iter_start(value connection, value collection, value
     CAMLreturn(ret_tuple);
 }
 
-CAMLprim value caml_castle_iter_next(value connection, value token, value size)
+CAMLprim value caml_castle_iter_start_byte(value connection, value collection, value start_key, value end_key, value size)
 {
-    CAMLparam3(connection, token, size);
+    return caml_castle_iter_start(connection, Int32_val(collection), start_key, end_key, Int_val(size));
+}
+
+CAMLprim value caml_castle_iter_next(value connection, int32_t token, intnat size)
+{
+    CAMLparam1(connection);
     CAMLlocal2(arr, ret_tuple);
 
     int ret, more;
@@ -462,8 +1009,8 @@ CAMLprim value caml_castle_iter_next(value connection, value token, value size)
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    buf_length = Int_val(size);
-    token_id = Int32_val(token);
+    buf_length = size;
+    token_id = token;
 
     enter_blocking_section();
     ret = castle_iter_next(conn, token_id, &kv_list, buf_length, &more);
@@ -484,9 +1031,14 @@ CAMLprim value caml_castle_iter_next(value connection, value token, value size)
     CAMLreturn(ret_tuple);
 }
 
-CAMLprim void caml_castle_iter_finish(value connection, value token)
+CAMLprim value caml_castle_iter_next_byte(value connection, value token, value size)
 {
-    CAMLparam2(connection, token);
+    return caml_castle_iter_next(connection, Int32_val(token), Int_val(size));
+}
+
+CAMLprim void caml_castle_iter_finish(value connection, int32_t token)
+{
+    CAMLparam1(connection);
 
     int ret;
     castle_connection *conn;
@@ -497,7 +1049,7 @@ CAMLprim void caml_castle_iter_finish(value connection, value token)
     conn = Castle_val(connection);
 
     enter_blocking_section();
-    ret = castle_iter_finish(conn, Int32_val(token));
+    ret = castle_iter_finish(conn, token);
     leave_blocking_section();
     if (ret)
     {
@@ -509,14 +1061,21 @@ CAMLprim void caml_castle_iter_finish(value connection, value token)
     CAMLreturn0;
 }
 
-CAMLprim value caml_castle_get_slice(value connection, value collection, value from_key_value, value to_key_value, value limit)
+CAMLprim value caml_castle_iter_finish_byte(value connection, value token)
 {
-    CAMLparam5(connection, collection, from_key_value, to_key_value, limit);
+    caml_castle_iter_finish(connection, Int32_val(token));
+    return Val_unit;
+}
+
+CAMLprim value caml_castle_get_slice(value connection, int32_t collection, value from_key_value, value to_key_value, intnat limit)
+{
+    CAMLparam3(connection, from_key_value, to_key_value);
     CAMLlocal1(result);
 
     int ret;
     uint32_t from_key_len, to_key_len, collection_id;
     castle_connection *conn;
+    struct castle_scratch *scratch;
     struct castle_key_value_list *kvs;
     castle_key *from_key, *to_key;
     void *buf;
@@ -524,13 +1083,18 @@ CAMLprim value caml_castle_get_slice(value connection, value collection, value f
     assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
     conn = Castle_val(connection);
 
-    collection_id = Int32_val(collection);
+    collection_id = collection;
 
     get_key_length(from_key_value, &from_key_len);
     get_key_length(to_key_value, &to_key_len);
 
-    buf = malloc(from_key_len + to_key_len);
-    if (!buf) caml_failwith("Error allocating key");
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, from_key_len + to_key_len);
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Error allocating key");
+    }
     from_key = buf;
     to_key = buf + from_key_len;
     copy_ocaml_key_to_buffer(from_key_value, from_key, from_key_len, EMPTY_MEANS_NEGATIVE_INFINITY);
@@ -538,10 +1102,10 @@ CAMLprim value caml_castle_get_slice(value connection, value collection, value f
 
     enter_blocking_section();
     ret = castle_getslice(conn, collection_id, from_key,
-        to_key, &kvs, Int_val(limit));
+        to_key, &kvs, limit);
     leave_blocking_section();
 
-    free(buf);
+    scratch_put(scratch);
 
     if (ret)
     {
@@ -557,65 +1121,842 @@ CAMLprim value caml_castle_get_slice(value connection, value collection, value f
     CAMLreturn(result);
 }
 
-/* IOCTLS */
+CAMLprim value caml_castle_get_slice_byte(value connection, value collection, value from_key_value, value to_key_value, value limit)
+{
+    return caml_castle_get_slice(connection, Int32_val(collection), from_key_value, to_key_value, Int_val(limit));
+}
 
-#define CAML_VAL_slave_uuid Int32_val
-#define CAML_VAL_collection_id Int32_val
-#define CAML_VAL_version Int32_val
-#define CAML_VAL_uint8 Bool_val
-#define CAML_VAL_uint32 Int32_val
-#define CAML_VAL_uint64 Int64_val
-#define CAML_VAL_size Int_val
-#define CAML_VAL_string String_val
-#define CAML_VAL_int32 Int32_val
-#define CAML_VAL_da_id_t Int32_val
-#define CAML_VAL_merge_id_t Int32_val
-#define CAML_VAL_thread_id_t Int32_val
-#define CAML_VAL_work_id_t Int32_val
-#define CAML_VAL_work_size_t Int64_val
-#define CAML_VAL_pid Int32_val
-#define CAML_VAL_c_da_opts_t Int64_val
+/* Typed codecs (see Castle.Codec). A codec is an OCaml array of
+   Int | Float | Fixed of int, one entry per field of the record it encodes.
+   Keys get one dimension per field, values are the fields back to back. Ints
+   and floats take 8 bytes, big-endian, encoded so that byte order matches
+   numeric order: flipping the sign bit makes two's complement integers sort
+   as unsigned, and negative floats have every bit flipped so that larger
+   magnitudes sort lower. Fixed fields are NUL-padded. */
 
-#define CAML_COPY_slave_uuid caml_copy_int32
-#define CAML_COPY_collection_id caml_copy_int32
-#define CAML_COPY_version caml_copy_int32
-#define CAML_COPY_uint32 caml_copy_int32
-#define CAML_COPY_string caml_copy_stri64
-#define CAML_COPY_int32 caml_copy_int32
-#define CAML_COPY_da_id_t caml_copy_int32
-#define CAML_COPY_merge_id_t caml_copy_int32
-#define CAML_COPY_thread_id_t caml_copy_int32
-#define CAML_COPY_work_id_t caml_copy_int32
-#define CAML_COPY_work_size_t caml_copy_int64
-#define CAML_COPY_pid caml_copy_int32
+#define CODEC_INT   Val_int(0)
+#define CODEC_FLOAT Val_int(1)
+#define CODEC_SIGN  (1ULL << 63)
 
-#define CASTLE_IOCTL_0IN_0OUT(_id, _name)                                           \
-CAMLprim void                                                                       \
-caml_castle_##_id (value connection)                                                     \
-{                                                                                   \
-        CAMLparam1(connection);                                                     \
-        castle_connection *conn;                                       \
-        int ret;                                                                    \
-                                                                                    \
-        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);        \
-        conn = Castle_val(connection);                                  \
-                                                                                    \
-        enter_blocking_section();                                                   \
-        ret = castle_##_id(conn);                                             \
+static uint32_t codec_field_width(value field)
+{
+    if (Is_long(field))
+        return 8;
+    return Long_val(Field(field, 0));
+}
+
+static uint32_t codec_width(value codec)
+{
+    uint32_t i, width = 0;
+
+    for (i = 0; i < Wosize_val(codec); i++)
+        width += codec_field_width(Field(codec, i));
+
+    return width;
+}
+
+static double codec_record_double(value record, uint32_t i)
+{
+    if (Tag_val(record) == Double_array_tag)
+        return Double_field(record, i);
+    return Double_val(Field(record, i));
+}
+
+static int codec_all_floats(value codec)
+{
+    uint32_t i;
+
+    for (i = 0; i < Wosize_val(codec); i++)
+        if (Field(codec, i) != CODEC_FLOAT)
+            return 0;
+
+    return 1;
+}
+
+/* Raises Invalid_argument, before anything has been allocated, unless
+   record is laid out the way codec says: a block of exactly one field per
+   codec field, each an int, a boxed float or a string that fits its Fixed
+   width. Records made only of floats are stored flat, as OCaml does. */
+static void codec_check(value codec, value record)
+{
+    uint32_t i, nr_fields = Wosize_val(codec);
+
+    if (Is_long(record))
+        caml_invalid_argument("Castle.Codec: value is not a record");
+
+    if (codec_all_floats(codec))
+    {
+        if (Tag_val(record) != Double_array_tag
+            || Wosize_val(record) != nr_fields * Double_wosize)
+            caml_invalid_argument("Castle.Codec: record does not match its codec");
+        return;
+    }
+
+    if (Tag_val(record) != 0 || Wosize_val(record) != nr_fields)
+        caml_invalid_argument("Castle.Codec: record does not match its codec");
+
+    for (i = 0; i < nr_fields; i++)
+    {
+        value field = Field(codec, i), v = Field(record, i);
+
+        if (field == CODEC_INT)
+        {
+            if (!Is_long(v))
+                caml_invalid_argument("Castle.Codec: record does not match its codec");
+        }
+        else if (field == CODEC_FLOAT)
+        {
+            if (Is_long(v) || Tag_val(v) != Double_tag)
+                caml_invalid_argument("Castle.Codec: record does not match its codec");
+        }
+        else
+        {
+            if (Is_long(v) || Tag_val(v) != String_tag)
+                caml_invalid_argument("Castle.Codec: record does not match its codec");
+            if (caml_string_length(v) > (mlsize_t)Long_val(Field(field, 0)))
+                caml_invalid_argument("Castle.Codec: string wider than its Fixed field");
+        }
+    }
+}
+
+/* Checks a sample record against a codec, when the codec is made. */
+CAMLprim value caml_castle_codec_check(value codec, value record)
+{
+    codec_check(codec, record);
+    return Val_unit;
+}
+
+static void codec_put_be64(uint8_t *buf, uint64_t x)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        buf[i] = x & 0xff;
+        x >>= 8;
+    }
+}
+
+static uint64_t codec_get_be64(const uint8_t *buf)
+{
+    uint64_t x = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        x = (x << 8) | buf[i];
+
+    return x;
+}
+
+/* Encodes field i of record into buf, which holds its width. */
+static void codec_encode_field(value field, value record, uint32_t i, uint8_t *buf)
+{
+    uint64_t bits;
+    double d;
+
+    if (field == CODEC_INT)
+        codec_put_be64(buf, (uint64_t)(int64_t)Long_val(Field(record, i)) ^ CODEC_SIGN);
+    else if (field == CODEC_FLOAT)
+    {
+        d = codec_record_double(record, i);
+        memcpy(&bits, &d, sizeof(bits));
+        codec_put_be64(buf, (bits & CODEC_SIGN) ? ~bits : bits ^ CODEC_SIGN);
+    }
+    else
+    {
+        mlsize_t len = caml_string_length(Field(record, i));
+        memcpy(buf, String_val(Field(record, i)), len);
+        memset(buf + len, 0, codec_field_width(field) - len);
+    }
+}
+
+static void codec_encode(value codec, value record, uint8_t *buf)
+{
+    uint32_t i;
+
+    for (i = 0; i < Wosize_val(codec); i++)
+    {
+        codec_encode_field(Field(codec, i), record, i, buf);
+        buf += codec_field_width(Field(codec, i));
+    }
+}
+
+/* Where field i of an encoded record is; see codec_decode. */
+static const uint8_t *codec_field_source(value src, const uint8_t *buf, const castle_key *key,
+                                         uint32_t i, uint32_t off)
+{
+    if (key)
+        return castle_key_elem_data(key, i);
+    if (src == Val_unit)
+        return buf + off;
+    if (Tag_val(src) == String_tag)
+        return (const uint8_t *)String_val(src) + off;
+    return (const uint8_t *)String_val(Field(src, i));
+}
+
+/* Builds a record from encoded fields, read from the dimensions of key if
+   it is not NULL, else from buf if src is Val_unit, and otherwise from
+   src: a string holding the fields back to back, or an array of strings
+   holding one each. Decoding allocates, which may move src, so a field's
+   address is only taken once nothing more will be allocated before it is
+   read. */
+static value codec_decode(value codec, value src, const uint8_t *buf, const castle_key *key)
+{
+    CAMLparam2(codec, src);
+    CAMLlocal2(record, field_value);
+
+    uint32_t i, width, off, nr_fields = Wosize_val(codec);
+    int all_floats = codec_all_floats(codec);
+    const uint8_t *p;
+    uint64_t bits;
+    double d;
+
+    /* Records made only of floats are stored flat. */
+    if (all_floats)
+        record = caml_alloc(nr_fields * Double_wosize, Double_array_tag);
+    else
+        record = caml_alloc(nr_fields, 0);
+
+    for (i = 0, off = 0; i < nr_fields; i++, off += width)
+    {
+        value field = Field(codec, i);
+        width = codec_field_width(field);
+        p = codec_field_source(src, buf, key, i, off);
+
+        if (field == CODEC_INT)
+            field_value = Val_long((int64_t)(codec_get_be64(p) ^ CODEC_SIGN));
+        else if (field == CODEC_FLOAT)
+        {
+            bits = codec_get_be64(p);
+            bits = (bits & CODEC_SIGN) ? bits ^ CODEC_SIGN : ~bits;
+            memcpy(&d, &bits, sizeof(d));
+            if (all_floats)
+            {
+                Store_double_field(record, i, d);
+                continue;
+            }
+            field_value = caml_copy_double(d);
+        }
+        else
+        {
+            uint32_t len = width;
+            while (len > 0 && p[len - 1] == '\0')
+                len--;
+            field_value = caml_alloc_string(len);
+            p = codec_field_source(src, buf, key, i, off);
+            memcpy(Bytes_val(field_value), p, len);
+        }
+
+        Store_field(record, i, field_value);
+    }
+
+    CAMLreturn(record);
+}
+
+/* The size of the castle_key for a codec, with one dimension per field. */
+static uint32_t codec_key_len(value codec)
+{
+    uint32_t i, nr_dims = Wosize_val(codec);
+    int lens[nr_dims];
+
+    for (i = 0; i < nr_dims; i++)
+        lens[i] = codec_field_width(Field(codec, i));
+
+    return castle_key_bytes_needed(nr_dims, lens, NULL, NULL);
+}
+
+static uint32_t codec_widest(value codec)
+{
+    uint32_t i, widest = 0;
+
+    for (i = 0; i < Wosize_val(codec); i++)
+        if (codec_field_width(Field(codec, i)) > widest)
+            widest = codec_field_width(Field(codec, i));
+
+    return widest;
+}
+
+/* The scratch a codec key needs: the key itself, then as many zero bytes
+   as the widest field. */
+static size_t codec_key_scratch(value codec)
+{
+    return ALIGN_UP(codec_key_len(codec), __alignof__(castle_key)) + codec_widest(codec);
+}
+
+/* Encodes record as a castle_key, with one dimension per field, into buf,
+   which holds codec_key_scratch bytes. castle_build_key lays the key out
+   with every field zeroed, except Fixed fields that fill their width,
+   which it copies straight from the record; the rest are then encoded in
+   place. */
+static castle_key *codec_build_key(value codec, value record, void *buf, uint32_t key_len)
+{
+    uint32_t i, nr_dims = Wosize_val(codec);
+    int lens[nr_dims];
+    const uint8_t *dims[nr_dims];
+    uint8_t flags[nr_dims];
+    uint8_t *zeros = (uint8_t *)buf + ALIGN_UP(key_len, __alignof__(castle_key));
+    castle_key *key = buf;
+
+    memset(zeros, 0, codec_widest(codec));
+
+    for (i = 0; i < nr_dims; i++)
+    {
+        value field = Field(codec, i);
+
+        lens[i] = codec_field_width(field);
+        flags[i] = 0;
+        dims[i] = zeros;
+        if (Is_block(field) && caml_string_length(Field(record, i)) == (mlsize_t)lens[i])
+            dims[i] = (const uint8_t *)String_val(Field(record, i));
+    }
+
+    castle_build_key(key, key_len, nr_dims, lens, dims, flags);
+
+    for (i = 0; i < nr_dims; i++)
+        if (dims[i] == zeros)
+            codec_encode_field(Field(codec, i), record, i,
+                               (uint8_t *)castle_key_elem_data(key, i));
+
+    return key;
+}
+
+CAMLprim value caml_castle_codec_get(value connection, int32_t collection,
+                                     value key_codec, value key_record, value val_codec)
+{
+    CAMLparam4(connection, key_codec, key_record, val_codec);
+    CAMLlocal1(result);
+
+    int ret;
+    uint32_t key_len, val_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_key *key;
+    void *buf;
+    char *val;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    codec_check(key_codec, key_record);
+    key_len = codec_key_len(key_codec);
+
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, codec_key_scratch(key_codec));
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Error allocating key");
+    }
+    key = codec_build_key(key_codec, key_record, buf, key_len);
+
+    enter_blocking_section();
+    ret = castle_get(conn, collection, key, &val, &val_len);
+    leave_blocking_section();
+
+    scratch_put(scratch);
+
+    if (ret == -ENOENT)
+        caml_raise_not_found();
+    if (ret)
+        unix_error(-ret, "codec_get", Nothing);
+
+    if (val_len != codec_width(val_codec))
+    {
+        free(val);
+        caml_failwith("Castle.Codec: stored value does not match its codec");
+    }
+
+    result = codec_decode(val_codec, Val_unit, (uint8_t *)val, NULL);
+    free(val);
+
+    CAMLreturn(result);
+}
+
+CAMLprim value caml_castle_codec_get_byte(value connection, value collection,
+                                          value key_codec, value key_record, value val_codec)
+{
+    return caml_castle_codec_get(connection, Int32_val(collection), key_codec, key_record, val_codec);
+}
+
+CAMLprim void caml_castle_codec_replace(value connection, int32_t collection,
+                                        value key_codec, value key_record,
+                                        value val_codec, value val_record)
+{
+    CAMLparam5(connection, key_codec, key_record, val_codec, val_record);
+
+    int ret;
+    uint32_t key_len, val_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_key *key;
+    void *buf;
+    char *val;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    codec_check(key_codec, key_record);
+    codec_check(val_codec, val_record);
+    key_len = codec_key_len(key_codec);
+
+    /* The key, then the value, in one reservation. */
+    val_len = codec_width(val_codec);
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, codec_key_scratch(key_codec) + val_len);
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Could not alloc buffer.");
+    }
+    key = codec_build_key(key_codec, key_record, buf, key_len);
+    val = (char *)buf + codec_key_scratch(key_codec);
+    codec_encode(val_codec, val_record, (uint8_t *)val);
+
+    enter_blocking_section();
+    ret = castle_replace(conn, collection, key, val, val_len);
+    leave_blocking_section();
+
+    scratch_put(scratch);
+
+    if (ret)
+        unix_error(-ret, "codec_replace", Nothing);
+
+    CAMLreturn0;
+}
+
+CAMLprim value caml_castle_codec_replace_byte(value *argv, int argn)
+{
+    assert(argn == 6);
+    caml_castle_codec_replace(argv[0], Int32_val(argv[1]), argv[2], argv[3], argv[4], argv[5]);
+    return Val_unit;
+}
+
+CAMLprim void caml_castle_codec_remove(value connection, int32_t collection,
+                                       value key_codec, value key_record)
+{
+    CAMLparam3(connection, key_codec, key_record);
+
+    int ret;
+    uint32_t key_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    castle_key *key;
+    void *buf;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    codec_check(key_codec, key_record);
+    key_len = codec_key_len(key_codec);
+
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, codec_key_scratch(key_codec));
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Could not alloc buffer.");
+    }
+    key = codec_build_key(key_codec, key_record, buf, key_len);
+
+    enter_blocking_section();
+    ret = castle_remove(conn, collection, key);
+    leave_blocking_section();
+
+    scratch_put(scratch);
+
+    if (ret)
+        unix_error(-ret, "codec_remove", Nothing);
+
+    CAMLreturn0;
+}
+
+CAMLprim value caml_castle_codec_remove_byte(value connection, value collection,
+                                             value key_codec, value key_record)
+{
+    caml_castle_codec_remove(connection, Int32_val(collection), key_codec, key_record);
+    return Val_unit;
+}
+
+/* The key as a plain string array, e.g. for get_slice bounds. */
+CAMLprim value caml_castle_codec_encode_key(value key_codec, value key_record)
+{
+    CAMLparam2(key_codec, key_record);
+    CAMLlocal2(key, dim);
+
+    uint32_t i, nr_dims = Wosize_val(key_codec);
+
+    codec_check(key_codec, key_record);
+
+    key = caml_alloc(nr_dims, 0);
+    for (i = 0; i < nr_dims; i++)
+    {
+        dim = caml_alloc_string(codec_field_width(Field(key_codec, i)));
+        Store_field(key, i, dim);
+    }
+
+    /* Nothing more is allocated, so the dimensions stay put while each
+       field is encoded straight into its own. */
+    for (i = 0; i < nr_dims; i++)
+        codec_encode_field(Field(key_codec, i), key_record, i,
+                           (uint8_t *)Bytes_val(Field(key, i)));
+
+    CAMLreturn(key);
+}
+
+/* Decodes an encoded key or value straight out of its OCaml strings. */
+CAMLprim value caml_castle_codec_decode_key(value key_codec, value key)
+{
+    CAMLparam2(key_codec, key);
+    CAMLlocal1(result);
+
+    uint32_t i, nr_dims = Wosize_val(key_codec);
+
+    if (Wosize_val(key) != nr_dims)
+        caml_invalid_argument("Castle.Codec: key does not match its codec");
+    for (i = 0; i < nr_dims; i++)
+        if (caml_string_length(Field(key, i)) != codec_field_width(Field(key_codec, i)))
+            caml_invalid_argument("Castle.Codec: key does not match its codec");
+
+    result = codec_decode(key_codec, key, NULL, NULL);
+
+    CAMLreturn(result);
+}
+
+CAMLprim value caml_castle_codec_decode_value(value val_codec, value val)
+{
+    CAMLparam2(val_codec, val);
+    CAMLlocal1(result);
+
+    if (caml_string_length(val) != codec_width(val_codec))
+        caml_invalid_argument("Castle.Codec: value does not match its codec");
+
+    result = codec_decode(val_codec, val, NULL, NULL);
+
+    CAMLreturn(result);
+}
+
+/* Raises Failure, having freed kv_list, unless every pair in it has a key
+   with a dimension of the right width per field of key_codec and a value
+   as wide as val_codec. */
+static void codec_kv_list_check(value key_codec, value val_codec, struct castle_key_value_list *kv_list)
+{
+    struct castle_key_value_list *cur;
+    uint32_t i, nr_dims = Wosize_val(key_codec), val_len = codec_width(val_codec);
+
+    for (cur = kv_list; cur; cur = cur->next)
+    {
+        int ok = castle_key_dims(cur->key) == nr_dims && cur->val->length == val_len;
+
+        for (i = 0; ok && i < nr_dims; i++)
+            ok = castle_key_elem_len(cur->key, i) == codec_field_width(Field(key_codec, i));
+        if (!ok)
+        {
+            castle_kvs_free(kv_list);
+            caml_failwith("Castle.Codec: stored pair does not match its codecs");
+        }
+    }
+}
+
+/* Decodes a key/value list straight into an array of (key, value) records,
+   reading each field from the list itself, and frees the list. */
+static value codec_kv_list_to_ocaml(value key_codec, value val_codec, struct castle_key_value_list *kv_list)
+{
+    CAMLparam2(key_codec, val_codec);
+    CAMLlocal4(arr, kv_tuple, key_record, val_record);
+
+    struct castle_key_value_list *cur;
+    uint32_t i, count = 0;
+
+    codec_kv_list_check(key_codec, val_codec, kv_list);
+
+    for (cur = kv_list; cur; cur = cur->next)
+        count++;
+
+    if (count == 0)
+    {
+        castle_kvs_free(kv_list);
+        CAMLreturn(Atom(0));
+    }
+
+    arr = caml_alloc(count, 0);
+    for (i = 0, cur = kv_list; cur; i++, cur = cur->next)
+    {
+        key_record = codec_decode(key_codec, Val_unit, NULL, cur->key);
+        val_record = codec_decode(val_codec, Val_unit, (const uint8_t *)cur->val->val, NULL);
+        kv_tuple = caml_alloc(2, 0);
+        Store_field(kv_tuple, 0, key_record);
+        Store_field(kv_tuple, 1, val_record);
+        Store_field(arr, i, kv_tuple);
+    }
+
+    castle_kvs_free(kv_list);
+
+    CAMLreturn(arr);
+}
+
+/* Where the end key of a range goes, after the start key, in scratch. */
+static size_t codec_range_end(value codec)
+{
+    return ALIGN_UP(codec_key_scratch(codec), __alignof__(castle_key));
+}
+
+/* Gets the pairs from start_record to end_record, both included, decoded
+   straight from the list libcastle returns. */
+CAMLprim value caml_castle_codec_get_slice(value connection, int32_t collection,
+                                           value key_codec, value start_record, value end_record,
+                                           value val_codec, intnat limit)
+{
+    CAMLparam5(connection, key_codec, start_record, end_record, val_codec);
+
+    int ret;
+    uint32_t key_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    struct castle_key_value_list *kvs;
+    castle_key *start_key, *end_key;
+    void *buf;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    codec_check(key_codec, start_record);
+    codec_check(key_codec, end_record);
+    key_len = codec_key_len(key_codec);
+
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, codec_range_end(key_codec) + codec_key_scratch(key_codec));
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Error allocating key");
+    }
+    start_key = codec_build_key(key_codec, start_record, buf, key_len);
+    end_key = codec_build_key(key_codec, end_record,
+                              (char *)buf + codec_range_end(key_codec), key_len);
+
+    enter_blocking_section();
+    ret = castle_getslice(conn, collection, start_key, end_key, &kvs, limit);
+    leave_blocking_section();
+
+    scratch_put(scratch);
+
+    if (ret)
+        unix_error(-ret, "codec_get_slice", Nothing);
+
+    CAMLreturn(codec_kv_list_to_ocaml(key_codec, val_codec, kvs));
+}
+
+CAMLprim value caml_castle_codec_get_slice_byte(value *argv, int argn)
+{
+    assert(argn == 7);
+    return caml_castle_codec_get_slice(argv[0], Int32_val(argv[1]), argv[2], argv[3],
+                                       argv[4], argv[5], Int_val(argv[6]));
+}
+
+/* Starts an iterator from start_record to end_record, both included;
+   returns (token, more, pairs) with the pairs decoded as in
+   caml_castle_codec_get_slice. */
+CAMLprim value caml_castle_codec_iter_start(value connection, int32_t collection,
+                                            value key_codec, value start_record, value end_record,
+                                            value val_codec, intnat size)
+{
+    CAMLparam5(connection, key_codec, start_record, end_record, val_codec);
+    CAMLlocal2(arr, ret_tuple);
+
+    int ret, more;
+    uint32_t key_len;
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    struct castle_key_value_list *kv_list;
+    castle_interface_token_t token;
+    castle_key *start_key, *end_key;
+    void *buf;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    codec_check(key_codec, start_record);
+    codec_check(key_codec, end_record);
+    key_len = codec_key_len(key_codec);
+
+    scratch = scratch_get(connection);
+    buf = scratch_reserve(scratch, codec_range_end(key_codec) + codec_key_scratch(key_codec));
+    if (!buf)
+    {
+        scratch_put(scratch);
+        caml_failwith("Could not alloc buffer.");
+    }
+    start_key = codec_build_key(key_codec, start_record, buf, key_len);
+    end_key = codec_build_key(key_codec, end_record,
+                              (char *)buf + codec_range_end(key_codec), key_len);
+
+    enter_blocking_section();
+    ret = castle_iter_start(conn, collection, start_key, end_key, &token, &kv_list, size, &more);
+    leave_blocking_section();
+
+    scratch_put(scratch);
+
+    if (ret)
+        unix_error(-ret, "codec_iter_start", Nothing);
+
+    arr = codec_kv_list_to_ocaml(key_codec, val_codec, kv_list);
+
+    ret_tuple = caml_alloc(3, 0);
+    Store_field(ret_tuple, 0, caml_copy_int32(token));
+    Store_field(ret_tuple, 1, more ? Val_int(1) : Val_int(0));
+    Store_field(ret_tuple, 2, arr);
+
+    CAMLreturn(ret_tuple);
+}
+
+CAMLprim value caml_castle_codec_iter_start_byte(value *argv, int argn)
+{
+    assert(argn == 7);
+    return caml_castle_codec_iter_start(argv[0], Int32_val(argv[1]), argv[2], argv[3],
+                                        argv[4], argv[5], Int_val(argv[6]));
+}
+
+/* Returns (more, pairs), decoded as in caml_castle_codec_get_slice. */
+CAMLprim value caml_castle_codec_iter_next(value connection, int32_t token,
+                                           value key_codec, value val_codec, intnat size)
+{
+    CAMLparam3(connection, key_codec, val_codec);
+    CAMLlocal2(arr, ret_tuple);
+
+    int ret, more;
+    castle_connection *conn;
+    struct castle_key_value_list *kv_list;
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    enter_blocking_section();
+    ret = castle_iter_next(conn, token, &kv_list, size, &more);
+    leave_blocking_section();
+
+    if (ret)
+        unix_error(-ret, "codec_iter_next", Nothing);
+
+    arr = codec_kv_list_to_ocaml(key_codec, val_codec, kv_list);
+
+    ret_tuple = caml_alloc(2, 0);
+    Store_field(ret_tuple, 0, more ? Val_int(1) : Val_int(0));
+    Store_field(ret_tuple, 1, arr);
+
+    CAMLreturn(ret_tuple);
+}
+
+CAMLprim value caml_castle_codec_iter_next_byte(value connection, value token,
+                                                value key_codec, value val_codec, value size)
+{
+    return caml_castle_codec_iter_next(connection, Int32_val(token), key_codec, val_codec, Int_val(size));
+}
+
+/* IOCTLS */
+
+/* Every ioctl stub comes in two flavours. The native one takes and returns
+   int32/int64 arguments unboxed (see the [@unboxed] externals in castle.ml),
+   so the native-code caller never allocates a box for an id. The _byte one is
+   the bytecode entry point, which unboxes its arguments and boxes the result
+   around a call to the native stub.
+
+   CAML_ARG_T_<type>  is the C type of the argument in the native stub,
+   CAML_VAL_<type>    converts that argument to the libcastle type,
+   CAML_BYTE_<type>   converts a bytecode value to the native argument,
+   CAML_COPY_<type>   boxes a native result for bytecode. */
+
+#define CAML_ARG_T_slave_uuid int32_t
+#define CAML_ARG_T_collection_id int32_t
+#define CAML_ARG_T_version int32_t
+#define CAML_ARG_T_uint8 value
+#define CAML_ARG_T_uint32 int32_t
+#define CAML_ARG_T_uint64 int64_t
+#define CAML_ARG_T_size value
+#define CAML_ARG_T_string value
+#define CAML_ARG_T_int32 int32_t
+#define CAML_ARG_T_da_id_t int32_t
+#define CAML_ARG_T_merge_id_t int32_t
+#define CAML_ARG_T_thread_id_t int32_t
+#define CAML_ARG_T_work_id_t int32_t
+#define CAML_ARG_T_work_size_t int64_t
+#define CAML_ARG_T_pid int32_t
+#define CAML_ARG_T_c_da_opts_t int64_t
+
+#define CAML_UNBOXED(_v) (_v)
+
+#define CAML_VAL_slave_uuid CAML_UNBOXED
+#define CAML_VAL_collection_id CAML_UNBOXED
+#define CAML_VAL_version CAML_UNBOXED
+#define CAML_VAL_uint8 Bool_val
+#define CAML_VAL_uint32 CAML_UNBOXED
+#define CAML_VAL_uint64 CAML_UNBOXED
+#define CAML_VAL_size Int_val
+#define CAML_VAL_string String_val
+#define CAML_VAL_int32 CAML_UNBOXED
+#define CAML_VAL_da_id_t CAML_UNBOXED
+#define CAML_VAL_merge_id_t CAML_UNBOXED
+#define CAML_VAL_thread_id_t CAML_UNBOXED
+#define CAML_VAL_work_id_t CAML_UNBOXED
+#define CAML_VAL_work_size_t CAML_UNBOXED
+#define CAML_VAL_pid CAML_UNBOXED
+#define CAML_VAL_c_da_opts_t CAML_UNBOXED
+
+#define CAML_BYTE_slave_uuid Int32_val
+#define CAML_BYTE_collection_id Int32_val
+#define CAML_BYTE_version Int32_val
+#define CAML_BYTE_uint8 CAML_UNBOXED
+#define CAML_BYTE_uint32 Int32_val
+#define CAML_BYTE_uint64 Int64_val
+#define CAML_BYTE_size CAML_UNBOXED
+#define CAML_BYTE_string CAML_UNBOXED
+#define CAML_BYTE_int32 Int32_val
+#define CAML_BYTE_da_id_t Int32_val
+#define CAML_BYTE_merge_id_t Int32_val
+#define CAML_BYTE_thread_id_t Int32_val
+#define CAML_BYTE_work_id_t Int32_val
+#define CAML_BYTE_work_size_t Int64_val
+#define CAML_BYTE_pid Int32_val
+#define CAML_BYTE_c_da_opts_t Int64_val
+
+#define CAML_COPY_slave_uuid caml_copy_int32
+#define CAML_COPY_collection_id caml_copy_int32
+#define CAML_COPY_version caml_copy_int32
+#define CAML_COPY_uint32 caml_copy_int32
+#define CAML_COPY_string caml_copy_stri64
+#define CAML_COPY_int32 caml_copy_int32
+#define CAML_COPY_da_id_t caml_copy_int32
+#define CAML_COPY_merge_id_t caml_copy_int32
+#define CAML_COPY_thread_id_t caml_copy_int32
+#define CAML_COPY_work_id_t caml_copy_int32
+#define CAML_COPY_work_size_t caml_copy_int64
+#define CAML_COPY_pid caml_copy_int32
+
+#define CASTLE_IOCTL_0IN_0OUT(_id, _name)                                           \
+CAMLprim void                                                                       \
+caml_castle_##_id (value connection)                                                \
+{                                                                                   \
+        CAMLparam1(connection);                                                     \
+        castle_connection *conn;                                                    \
+        int ret;                                                                    \
+                                                                                    \
+        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);          \
+        conn = Castle_val(connection);                                              \
+                                                                                    \
+        enter_blocking_section();                                                   \
+        ret = castle_##_id(conn);                                                   \
         leave_blocking_section();                                                   \
                                                                                     \
         if (ret)                                                                    \
-            unix_error(-ret, #_id, Nothing);                                         \
+            unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
         CAMLreturn0;                                                                \
 }                                                                                   \
 
 #define CASTLE_IOCTL_0IN_1OUT(_id, _name, _ret_1_t, _ret)                           \
-CAMLprim value                                                                      \
+CAMLprim CAML_ARG_T_##_ret_1_t                                                      \
 caml_castle_##_id (value connection)                                                \
 {                                                                                   \
         CAMLparam1(connection);                                                     \
-        CAMLlocal1(result);                                                         \
         castle_connection *conn;                                                    \
         int ret;                                                                    \
         C_TYPE_##_ret_1_t _ret;                                                     \
@@ -630,75 +1971,92 @@ caml_castle_##_id (value connection)
         if (ret)                                                                    \
             unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
-        result = CAML_COPY_##_ret_1_t(_ret);                                        \
+        CAMLreturnT(CAML_ARG_T_##_ret_1_t, _ret);                                   \
+}                                                                                   \
                                                                                     \
-        CAMLreturn(result);                                                         \
+CAMLprim value                                                                      \
+caml_castle_##_id##_byte (value connection)                                         \
+{                                                                                   \
+        return CAML_COPY_##_ret_1_t(caml_castle_##_id(connection));                 \
 }                                                                                   \
 
 #define CASTLE_IOCTL_1IN_0OUT(_id, _name, _arg_1_t, _arg_1)                         \
 CAMLprim void                                                                       \
-caml_castle_##_id (value connection, value _arg_1##_value)                               \
+caml_castle_##_id (value connection, CAML_ARG_T_##_arg_1_t _arg_1##_value)          \
 {                                                                                   \
-        CAMLparam2(connection, _arg_1##_value);                                     \
-        castle_connection *conn;                                       \
+        CAMLparam1(connection);                                                     \
+        castle_connection *conn;                                                    \
         int ret;                                                                    \
         C_TYPE_##_arg_1_t _arg_1;                                                   \
                                                                                     \
-        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);        \
-        conn = Castle_val(connection);                                  \
+        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);          \
+        conn = Castle_val(connection);                                              \
                                                                                     \
         _arg_1 = CAML_VAL_##_arg_1_t(_arg_1##_value);                               \
                                                                                     \
         enter_blocking_section();                                                   \
-        ret = castle_##_id(conn, _arg_1);                                     \
+        ret = castle_##_id(conn, _arg_1);                                           \
         leave_blocking_section();                                                   \
                                                                                     \
         if (ret)                                                                    \
-            unix_error(-ret, #_id, Nothing);                                         \
+            unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
         CAMLreturn0;                                                                \
 }                                                                                   \
+                                                                                    \
+CAMLprim value                                                                      \
+caml_castle_##_id##_byte (value connection, value _arg_1##_value)                   \
+{                                                                                   \
+        caml_castle_##_id(connection, CAML_BYTE_##_arg_1_t(_arg_1##_value));        \
+        return Val_unit;                                                            \
+}                                                                                   \
 
 #define CASTLE_IOCTL_1IN_1OUT(_id, _name, _arg_1_t, _arg_1, _ret_1_t, _ret)         \
-CAMLprim value                                                                      \
-caml_castle_##_id (value connection, value _arg_1##_value)              \
+CAMLprim CAML_ARG_T_##_ret_1_t                                                      \
+caml_castle_##_id (value connection, CAML_ARG_T_##_arg_1_t _arg_1##_value)          \
 {                                                                                   \
-        CAMLparam2(connection, _arg_1##_value);                                     \
-        CAMLlocal1(result);                                                         \
-        castle_connection *conn;                                       \
+        CAMLparam1(connection);                                                     \
+        castle_connection *conn;                                                    \
         int ret;                                                                    \
         C_TYPE_##_arg_1_t _arg_1;                                                   \
         C_TYPE_##_ret_1_t _ret;                                                     \
                                                                                     \
-        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);        \
-        conn = Castle_val(connection);                                  \
+        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);          \
+        conn = Castle_val(connection);                                              \
                                                                                     \
         _arg_1 = CAML_VAL_##_arg_1_t(_arg_1##_value);                               \
                                                                                     \
         enter_blocking_section();                                                   \
-        ret = castle_##_id(conn, _arg_1, &_ret);                              \
+        ret = castle_##_id(conn, _arg_1, &_ret);                                    \
         leave_blocking_section();                                                   \
                                                                                     \
         if (ret)                                                                    \
-            unix_error(-ret, #_id, Nothing);                                         \
+            unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
-        result = CAML_COPY_##_ret_1_t(_ret);                                        \
+        CAMLreturnT(CAML_ARG_T_##_ret_1_t, _ret);                                   \
+}                                                                                   \
                                                                                     \
-        CAMLreturn(result);                                                         \
+CAMLprim value                                                                      \
+caml_castle_##_id##_byte (value connection, value _arg_1##_value)                   \
+{                                                                                   \
+        return CAML_COPY_##_ret_1_t(                                                \
+            caml_castle_##_id(connection, CAML_BYTE_##_arg_1_t(_arg_1##_value)));   \
 }                                                                                   \
 
 #define CASTLE_IOCTL_2IN_0OUT(_id, _name, _arg_1_t, _arg_1, _arg_2_t, _arg_2)       \
 CAMLprim void                                                                       \
-caml_castle_##_id (value connection, value _arg_1##_value, value _arg_2##_value)    \
+caml_castle_##_id (value connection,                                                \
+                   CAML_ARG_T_##_arg_1_t _arg_1##_value,                            \
+                   CAML_ARG_T_##_arg_2_t _arg_2##_value)                            \
 {                                                                                   \
-        CAMLparam3(connection, _arg_1##_value, _arg_2##_value);                     \
-        castle_connection *conn;                                       \
+        CAMLparam1(connection);                                                     \
+        castle_connection *conn;                                                    \
         int ret;                                                                    \
         C_TYPE_##_arg_1_t _arg_1;                                                   \
         C_TYPE_##_arg_2_t _arg_2;                                                   \
                                                                                     \
-        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);        \
-        conn = Castle_val(connection);                                  \
+        assert(Is_block(connection) && Tag_val(connection) == Custom_tag);          \
+        conn = Castle_val(connection);                                              \
                                                                                     \
         _arg_1 = CAML_VAL_##_arg_1_t(_arg_1##_value);                               \
         _arg_2 = CAML_VAL_##_arg_2_t(_arg_2##_value);                               \
@@ -708,18 +2066,29 @@ caml_castle_##_id (value connection, value _arg_1##_value, value _arg_2##_value)
         leave_blocking_section();                                                   \
                                                                                     \
         if (ret)                                                                    \
-            unix_error(-ret, #_id, Nothing);                                         \
+            unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
         CAMLreturn0;                                                                \
 }                                                                                   \
+                                                                                    \
+CAMLprim value                                                                      \
+caml_castle_##_id##_byte (value connection, value _arg_1##_value,                   \
+                          value _arg_2##_value)                                     \
+{                                                                                   \
+        caml_castle_##_id(connection,                                               \
+                          CAML_BYTE_##_arg_1_t(_arg_1##_value),                     \
+                          CAML_BYTE_##_arg_2_t(_arg_2##_value));                    \
+        return Val_unit;                                                            \
+}                                                                                   \
 
 #define CASTLE_IOCTL_2IN_1OUT(_id, _name, _arg_1_t, _arg_1, _arg_2_t, _arg_2,       \
                               _ret_1_t, _ret)                                       \
-CAMLprim value                                                                      \
-caml_castle_##_id (value connection, value _arg_1##_value, value _arg_2##_value)    \
+CAMLprim CAML_ARG_T_##_ret_1_t                                                      \
+caml_castle_##_id (value connection,                                                \
+                   CAML_ARG_T_##_arg_1_t _arg_1##_value,                            \
+                   CAML_ARG_T_##_arg_2_t _arg_2##_value)                            \
 {                                                                                   \
-        CAMLparam3(connection, _arg_1##_value, _arg_2##_value);                     \
-        CAMLlocal1(result);                                                         \
+        CAMLparam1(connection);                                                     \
         castle_connection *conn;                                                    \
         int ret;                                                                    \
         C_TYPE_##_arg_1_t _arg_1;                                                   \
@@ -739,9 +2108,17 @@ caml_castle_##_id (value connection, value _arg_1##_value, value _arg_2##_value)
         if (ret)                                                                    \
             unix_error(-ret, #_id, Nothing);                                        \
                                                                                     \
-        result = CAML_COPY_##_ret_1_t(_ret);                                        \
+        CAMLreturnT(CAML_ARG_T_##_ret_1_t, _ret);                                   \
+}                                                                                   \
                                                                                     \
-        CAMLreturn(result);                                                         \
+CAMLprim value                                                                      \
+caml_castle_##_id##_byte (value connection, value _arg_1##_value,                   \
+                          value _arg_2##_value)                                     \
+{                                                                                   \
+        return CAML_COPY_##_ret_1_t(                                                \
+            caml_castle_##_id(connection,                                           \
+                              CAML_BYTE_##_arg_1_t(_arg_1##_value),                 \
+                              CAML_BYTE_##_arg_2_t(_arg_2##_value)));               \
 }                                                                                   \
 
 #define CASTLE_IOCTL_3IN_1OUT(_id, _name, _arg_1_t, _arg_1, _arg_2_t, _arg_2,       \
@@ -749,31 +2126,34 @@ caml_castle_##_id (value connection, value _arg_1##_value, value _arg_2##_value)
 
 CASTLE_IOCTLS
 
-CAMLprim value
+CAMLprim int32_t
 caml_castle_device_to_devno(value filename) {
   CAMLparam1(filename);
-  CAMLlocal1(result);
 
   size_t filename_len = caml_string_length(filename) + 1;
   char filename_buf[filename_len];
   uint32_t devno;
   memcpy(filename_buf, String_val(filename), filename_len);
-  filename_buf[filename_len] = '\0';
+  filename_buf[filename_len - 1] = '\0';
 
   enter_blocking_section();
   devno = castle_device_to_devno(filename_buf);
   leave_blocking_section();
 
-  result = caml_copy_int32(devno);
-  CAMLreturn(result);
+  CAMLreturnT(int32_t, devno);
+}
+
+CAMLprim value
+caml_castle_device_to_devno_byte(value filename) {
+  return caml_copy_int32(caml_castle_device_to_devno(filename));
 }
 
 CAMLprim value
-caml_castle_devno_to_device(value devno_v) {
-  CAMLparam1(devno_v);
+caml_castle_devno_to_device(int32_t devno_v) {
+  CAMLparam0();
   CAMLlocal1(result);
 
-  uint32_t devno = Int32_val(devno_v);
+  uint32_t devno = devno_v;
   const char *filename;
 
   enter_blocking_section();
@@ -785,62 +2165,285 @@ caml_castle_devno_to_device(value devno_v) {
 }
 
 CAMLprim value
-caml_castle_collection_attach (value connection, value version_v, value name_v)
+caml_castle_devno_to_device_byte(value devno_v) {
+  return caml_castle_devno_to_device(Int32_val(devno_v));
+}
+
+CAMLprim int32_t
+caml_castle_collection_attach (value connection, int32_t version_v, value name_v)
 {
-        CAMLparam3(connection, version_v, name_v);
-        CAMLlocal1(result);
+        CAMLparam2(connection, name_v);
         castle_connection *conn;
+        struct castle_scratch *scratch;
         int ret;
 
-        c_ver_t version = Int32_val(version_v);
+        c_ver_t version = version_v;
         size_t name_len = caml_string_length(name_v) + 1;
-        char *name = malloc(name_len);
+        char *name;
 
         c_collection_id_t collection;
 
         assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
         conn = Castle_val(connection);
 
+        scratch = scratch_get(connection);
+        name = scratch_reserve(scratch, name_len);
+        if (!name)
+        {
+            scratch_put(scratch);
+            caml_failwith("Could not alloc buffer.");
+        }
         memcpy(name, String_val(name_v), name_len);
 
         enter_blocking_section();
         ret = castle_collection_attach(conn, version, name, name_len, &collection);
         leave_blocking_section();
 
-        free(name);
+        scratch_put(scratch);
 
         if (ret)
             unix_error(-ret, "collection_attach", Nothing);
 
-        result = caml_copy_int32(collection);
+        CAMLreturnT(int32_t, collection);
+}
 
-        CAMLreturn(result);
+CAMLprim value
+caml_castle_collection_attach_byte (value connection, value version_v, value name_v)
+{
+        return caml_copy_int32(caml_castle_collection_attach(connection, Int32_val(version_v), name_v));
 }
 
 CAMLprim void
-caml_castle_environment_set(value connection, value val_id, value data_v) {
-  CAMLparam3(connection, val_id, data_v);
+caml_castle_environment_set(value connection, int32_t val_id, value data_v) {
+  CAMLparam2(connection, data_v);
   castle_connection *conn;
+  struct castle_scratch *scratch;
 
-  castle_env_var_id id = Int32_val(val_id);
+  castle_env_var_id id = val_id;
   size_t data_len = caml_string_length(data_v) + 1;
-  char *data = malloc(data_len);
+  char *data;
   int ign;
 
   assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
   conn = Castle_val(connection);
 
+  scratch = scratch_get(connection);
+  data = scratch_reserve(scratch, data_len);
+  if (!data) {
+    scratch_put(scratch);
+    caml_failwith("Could not alloc buffer.");
+  }
   memcpy(data, String_val(data_v), data_len);
 
   enter_blocking_section();
   castle_environment_set(conn, id, data, data_len, &ign);
   leave_blocking_section();
 
-  free(data);
+  scratch_put(scratch);
 
   CAMLreturn0;
 }
 
+CAMLprim value
+caml_castle_environment_set_byte(value connection, value val_id, value data_v) {
+  caml_castle_environment_set(connection, Int32_val(val_id), data_v);
+  return Val_unit;
+}
+
+/* The kinds of control operation caml_castle_control_batch runs, in the
+   constructor order of Castle.control_op. */
+enum control_kind {
+    CONTROL_CLONE,
+    CONTROL_DELETE_VERSION,
+    CONTROL_CREATE,
+    CONTROL_COLLECTION_ATTACH,
+    CONTROL_COLLECTION_DETACH,
+    CONTROL_COLLECTION_SNAPSHOT,
+    CONTROL_VERTREE_COMPACT,
+    CONTROL_DESTROY_VERTREE,
+    CONTROL_VERTREE_TDP_SET,
+};
+
+/* A control_op unpacked from the OCaml heap, so that the batch can run
+   with the runtime lock released. */
+struct control_op {
+    enum control_kind kind;
+    uint32_t id;
+    uint64_t arg_1, arg_2;
+    char *name;
+    size_t name_len;
+    uint32_t out;
+    int ret;
+};
+
+static void control_op_do(castle_connection *conn, struct control_op *op)
+{
+    c_ver_t version;
+    c_collection_id_t collection;
+
+    switch (op->kind)
+    {
+        case CONTROL_CLONE:
+            op->ret = castle_clone(conn, op->id, &version);
+            op->out = version;
+            break;
+        case CONTROL_DELETE_VERSION:
+            op->ret = castle_delete_version(conn, op->id);
+            break;
+        case CONTROL_CREATE:
+            op->ret = castle_create_with_opts(conn, op->arg_1, op->arg_2, &version);
+            op->out = version;
+            break;
+        case CONTROL_COLLECTION_ATTACH:
+            op->ret = castle_collection_attach(conn, op->id, op->name, op->name_len, &collection);
+            op->out = collection;
+            break;
+        case CONTROL_COLLECTION_DETACH:
+            op->ret = castle_collection_detach(conn, op->id);
+            break;
+        case CONTROL_COLLECTION_SNAPSHOT:
+            op->ret = castle_collection_snapshot(conn, op->id, &version);
+            op->out = version;
+            break;
+        case CONTROL_VERTREE_COMPACT:
+            op->ret = castle_vertree_compact(conn, op->id);
+            break;
+        case CONTROL_DESTROY_VERTREE:
+            op->ret = castle_destroy_vertree(conn, op->id);
+            break;
+        case CONTROL_VERTREE_TDP_SET:
+            op->ret = castle_vertree_tdp_set(conn, op->id, op->arg_1);
+            break;
+    }
+}
+
+static int control_op_has_out(enum control_kind kind)
+{
+    return kind == CONTROL_CLONE
+        || kind == CONTROL_CREATE
+        || kind == CONTROL_COLLECTION_ATTACH
+        || kind == CONTROL_COLLECTION_SNAPSHOT;
+}
+
+/* What an op came to, kept in an OCaml string until the results are
+   built, so that no scratch is held while allocating them. */
+struct control_outcome {
+    int ret;
+    uint32_t out;
+};
+
+/* Runs every op of the array in order, inside a single blocking section.
+   The ops are still issued one ioctl at a time on this connection; the
+   batch only saves releasing and retaking the runtime lock around each.
+   An op failing does not stop the rest; each gets a result of its own. */
+CAMLprim value
+caml_castle_control_batch(value connection, value ops_v)
+{
+    CAMLparam2(connection, ops_v);
+    CAMLlocal5(op_v, results, result, field_v, outcomes_v);
+
+    castle_connection *conn;
+    struct castle_scratch *scratch;
+    struct control_op *ops;
+    struct control_outcome *outcomes;
+    char *names;
+    size_t names_len = 0;
+    mlsize_t i, nr_ops = Wosize_val(ops_v);
+
+    assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+    conn = Castle_val(connection);
+
+    if (nr_ops == 0)
+        CAMLreturn(Atom(0));
+
+    for (i = 0; i < nr_ops; i++)
+    {
+        op_v = Field(ops_v, i);
+        if (Tag_val(op_v) == CONTROL_COLLECTION_ATTACH)
+            names_len += caml_string_length(Field(op_v, 1)) + 1;
+    }
+
+    outcomes_v = caml_alloc_string(nr_ops * sizeof(*outcomes));
+
+    scratch = scratch_get(connection);
+    ops = scratch_reserve(scratch, nr_ops * sizeof(*ops) + names_len);
+    if (!ops)
+    {
+        scratch_put(scratch);
+        caml_failwith("Could not alloc buffer.");
+    }
+    names = (char *)(ops + nr_ops);
+
+    for (i = 0; i < nr_ops; i++)
+    {
+        op_v = Field(ops_v, i);
+        ops[i].kind = Tag_val(op_v);
+        ops[i].out = 0;
+        switch (ops[i].kind)
+        {
+            case CONTROL_CREATE:
+                ops[i].arg_1 = Int64_val(Field(op_v, 0));
+                ops[i].arg_2 = Int64_val(Field(op_v, 1));
+                break;
+            case CONTROL_COLLECTION_ATTACH:
+                ops[i].id = Int32_val(Field(op_v, 0));
+                ops[i].name = names;
+                ops[i].name_len = caml_string_length(Field(op_v, 1)) + 1;
+                memcpy(names, String_val(Field(op_v, 1)), ops[i].name_len);
+                names += ops[i].name_len;
+                break;
+            case CONTROL_VERTREE_TDP_SET:
+                ops[i].id = Int32_val(Field(op_v, 0));
+                ops[i].arg_1 = Int64_val(Field(op_v, 1));
+                break;
+            default:
+                ops[i].id = Int32_val(Field(op_v, 0));
+                break;
+        }
+    }
+
+    enter_blocking_section();
+    for (i = 0; i < nr_ops; i++)
+        control_op_do(conn, &ops[i]);
+    leave_blocking_section();
+
+    outcomes = (struct control_outcome *)Bytes_val(outcomes_v);
+    for (i = 0; i < nr_ops; i++)
+    {
+        outcomes[i].ret = ops[i].ret;
+        outcomes[i].out = ops[i].out;
+    }
+    scratch_put(scratch);
+
+    /* Results are Control_done, Control_id of int32 or
+       Control_failed of Unix.error. Building them allocates, which may
+       move outcomes_v, so each outcome is copied out before its result
+       is built. */
+    results = caml_alloc(nr_ops, 0);
+    for (i = 0; i < nr_ops; i++)
+    {
+        struct control_outcome outcome = ((struct control_outcome *)Bytes_val(outcomes_v))[i];
+
+        if (outcome.ret)
+        {
+            field_v = unix_error_of_code(-outcome.ret);
+            result = caml_alloc(1, 1);
+            Store_field(result, 0, field_v);
+        }
+        else if (control_op_has_out(Tag_val(Field(ops_v, i))))
+        {
+            field_v = caml_copy_int32(outcome.out);
+            result = caml_alloc(1, 0);
+            Store_field(result, 0, field_v);
+        }
+        else
+            result = Val_int(0);
+        Store_field(results, i, result);
+    }
+
+    CAMLreturn(results);
+}
+
 CAMLprim value
 caml_castle_merge_start(
         value connection,
@@ -892,14 +2495,41 @@ caml_castle_merge_start(
     CAMLreturn(result);
 }
 
+/* Bytecode passes primitives of more than five arguments as an array. */
+CAMLprim value
+caml_castle_merge_start_byte(value *argv, int argn)
+{
+    assert(argn == 8);
+    return caml_castle_merge_start(argv[0], argv[1], argv[2], argv[3],
+                                   argv[4], argv[5], argv[6], argv[7]);
+}
+
+/* Bound [@@noalloc]: must not allocate, raise or release the runtime lock. */
 CAMLprim value
 caml_castle_fd(value connection) {
-  CAMLparam1(connection);
   castle_connection *conn;
 
   assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
   conn = Castle_val(connection);
 
-  int fd = castle_fd(conn);
-  CAMLreturn(Val_int(fd));
+  return Val_int(castle_fd(conn));
+}
+
+CAMLprim value caml_castle_scratch_stats(value connection)
+{
+  CAMLparam1(connection);
+  CAMLlocal1(stats);
+
+  struct caml_castle_connection *c;
+
+  assert(Is_block(connection) && Tag_val(connection) == Custom_tag);
+  c = Connection_val(connection);
+
+  stats = caml_alloc(4, 0);
+  Store_field(stats, 0, Val_long(c->scratch.high_water));
+  Store_field(stats, 1, Val_long(c->scratch.size));
+  Store_field(stats, 2, Val_long(c->scratch.grows));
+  Store_field(stats, 3, Val_long(c->fallbacks));
+
+  CAMLreturn(stats);
 }
@@ -0,0 +1,88 @@
+(* Castle.Codec key encodings must sort byte-wise the way the values they
+   encode compare, and decode back to what was encoded. Neither needs a
+   running Castle. *)
+
+open Printf
+
+type int_key = { i : int }
+type float_key = { f : float }
+type fixed_key = { s : string }
+type mixed = { name : string; n : int; x : float }
+
+let failures = ref 0
+
+let check what ok =
+    if not ok then begin
+        incr failures;
+        printf "FAIL: %s\n" what
+    end
+
+(* Castle orders keys dimension by dimension, each byte-wise. *)
+let compare_encoded a b =
+    let rec loop i =
+        if i = Array.length a || i = Array.length b then
+            compare (Array.length a) (Array.length b)
+        else match String.compare a.(i) b.(i) with
+            | 0 -> loop (i + 1)
+            | c -> c
+    in
+    loop 0
+
+let sign c = if c < 0 then -1 else if c > 0 then 1 else 0
+
+(* Every pair of values must compare the same way encoded as not. *)
+let check_order name codec show values =
+    List.iter (fun a ->
+        List.iter (fun b ->
+            let ea = Castle.Codec.encode_key codec a
+            and eb = Castle.Codec.encode_key codec b in
+            check (sprintf "%s: %s vs %s sorts as encoded" name (show a) (show b))
+                (sign (compare a b) = sign (compare_encoded ea eb))) values) values
+
+let check_round_trip name codec show values =
+    List.iter (fun a ->
+        let back = Castle.Codec.decode_key codec (Castle.Codec.encode_key codec a) in
+        check (sprintf "%s: %s decodes to itself" name (show a)) (back = a)) values
+
+let () =
+    let ic = Castle.Codec.make [| Castle.Codec.Int |] { i = 0 } in
+    let ints = List.map (fun i -> { i = i })
+        [ min_int; -1_000_000; -256; -1; 0; 1; 255; 256; 1_000_000; max_int ] in
+    let show_int k = string_of_int k.i in
+    check_order "Int" ic show_int ints;
+    check_round_trip "Int" ic show_int ints;
+
+    (* -0.0 is left out: it compares equal to 0.0 but encodes below it. *)
+    let fc = Castle.Codec.make [| Castle.Codec.Float |] { f = 0. } in
+    let floats = List.map (fun f -> { f = f })
+        [ neg_infinity; -1e300; -2.5; -1.0; -1e-300; 0.0; 1e-300; 1.0; 2.5; 1e300; infinity ] in
+    let show_float k = sprintf "%h" k.f in
+    check_order "Float" fc show_float floats;
+    check_round_trip "Float" fc show_float floats;
+
+    let sc = Castle.Codec.make [| Castle.Codec.Fixed 4 |] { s = "" } in
+    let strings = List.map (fun s -> { s = s }) [ ""; "a"; "ab"; "abc"; "abcd"; "b"; "zz" ] in
+    let show_string k = sprintf "%S" k.s in
+    check_order "Fixed" sc show_string strings;
+    check_round_trip "Fixed" sc show_string strings;
+
+    let mc = Castle.Codec.make
+        [| Castle.Codec.Fixed 8; Castle.Codec.Int; Castle.Codec.Float |]
+        { name = ""; n = 0; x = 0. } in
+    let rows = [ { name = "alpha"; n = -3; x = 0.5 }; { name = "beta"; n = 7; x = -2.0 } ] in
+    check_round_trip "mixed" mc (fun r -> r.name) rows;
+    check "mixed: one dimension per field"
+        (Array.length (Castle.Codec.encode_key mc (List.hd rows)) = 3);
+
+    check "a string wider than its field is rejected"
+        (try ignore (Castle.Codec.encode_key sc { s = "abcde" }); false
+         with Invalid_argument _ -> true);
+    check "a sample of the wrong shape is rejected"
+        (try ignore (Castle.Codec.make [| Castle.Codec.Int; Castle.Codec.Int |] { i = 0 }); false
+         with Invalid_argument _ -> true);
+
+    if !failures > 0 then begin
+        printf "%d codec checks failed\n" !failures;
+        exit 1
+    end;
+    print_endline "codec: ok"
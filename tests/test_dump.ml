@@ -0,0 +1,55 @@
+(* A dump written with Castle.Dump.write must read back entry for entry,
+   through get, get_slice and iter, across block boundaries. None of this
+   needs a running Castle. *)
+
+open Printf
+open FSTypes2
+
+let failures = ref 0
+
+let check what ok =
+    if not ok then begin
+        incr failures;
+        printf "FAIL: %s\n" what
+    end
+
+let key i = [| sprintf "%05d" (i / 10); sprintf "%03d" (i mod 10) |]
+let value i = String.make (i mod 37) (Char.chr (97 + i mod 26))
+
+let () =
+    let n = 1000 in
+    let pairs = Array.init n (fun i -> (key i, Value (value i))) in
+    let filename = Filename.temp_file "castle_dump" ".dump" in
+    (* Small blocks, so that lookups cross many of them. *)
+    let written = Castle.Dump.write ~block_size:256 filename pairs in
+    check "every pair is written" (written = n);
+
+    let t = Castle.Dump.open_file filename in
+    check "length counts every pair" (Castle.Dump.length t = n);
+    Array.iteri (fun i (k, v) ->
+        check (sprintf "get %d" i) (Castle.Dump.get t k = v)) pairs;
+    check "a missing key is a tombstone" (Castle.Dump.get t [| "zzzzz"; "000" |] = Tombstone);
+    check "a key before the first is a tombstone" (Castle.Dump.get t [| ""; "" |] = Tombstone);
+
+    let seen = ref [] in
+    Castle.Dump.iter (fun k v -> seen := (k, Value v) :: !seen) t;
+    check "iter visits every pair in order" (Array.of_list (List.rev !seen) = pairs);
+
+    let slice = Castle.Dump.get_slice t (key 200) (key 299) 0 in
+    check "get_slice covers the range" (slice = Array.sub pairs 200 100);
+    let limited = Castle.Dump.get_slice t (key 200) (key 299) 7 in
+    check "get_slice stops at the limit" (limited = Array.sub pairs 200 7);
+
+    Sys.remove filename;
+
+    let unsorted = [| (key 2, Value "b"); (key 1, Value "a") |] in
+    check "pairs out of order are rejected"
+        (try ignore (Castle.Dump.write filename unsorted); false
+         with Invalid_argument _ -> true);
+    check "a rejected dump leaves no file" (not (Sys.file_exists filename));
+
+    if !failures > 0 then begin
+        printf "%d dump checks failed\n" !failures;
+        exit 1
+    end;
+    print_endline "dump: ok"